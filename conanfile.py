@@ -36,6 +36,7 @@ class Recipe(ConanFile):
         self.requires("opencl-headers/2023.04.17")
         self.requires("opencl-icd-loader/2023.04.17")
         self.requires("opengl/system")
+        self.requires("benchmark/1.8.0")
 
     def generate(self):
         copy(self, "*glfw*", os.path.join(self.dependencies["imgui"].package_folder,
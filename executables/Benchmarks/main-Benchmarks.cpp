@@ -0,0 +1,404 @@
+#define _USE_MATH_DEFINES
+#include <filesystem>
+#include <map>
+#include <math.h>
+#include <memory>
+
+#include <benchmark/benchmark.h>
+
+#include "glm/glm.hpp"
+
+#include "CloudMask.h"
+#include "CloudShadowMatching.h"
+#include "ComputeContext.h"
+#include "ComputeEnvironment.h"
+#include "GaussianBlur.h"
+#include "ImageOperations.h"
+#include "Imageio.h"
+#include "PitFillAlgorithm.h"
+#include "PotentialShadowMask.h"
+#include "ProbabilityRefinement.h"
+#include "SceneClassificationLayer.h"
+#include "ShadowMaskEvaluation.h"
+#include "SyntheticScene.h"
+#include "VectorGridOperations.h"
+#include "boilerplate/Log.h"
+#include "types.h"
+
+using namespace ImageOperations;
+using namespace CloudMask;
+using namespace PotentialShadowMask;
+using namespace CloudShadowMatching;
+using namespace VectorGridOperations;
+using namespace ProbabilityRefinement;
+using namespace ShadowMaskEvaluation;
+
+using Scene = SyntheticScene::Scene;
+
+namespace {
+const float DistanceToSun  = 1.5e9f;
+const float DistanceToView = 785.f;
+
+// Clouds scale with the scene, the count is picked so the expected cover matches once overlaps
+// are accounted for
+Scene GenerateScene(int size, float cloudCover) {
+    SyntheticScene::Parameters parameters;
+    parameters.size        = size;
+    parameters.cloudRadius = float(size) * glm::vec2(.01f, .05f);
+    float meanArea         = float(M_PI) * powf(.03f * float(size), 2.f);
+    parameters.cloudCount
+        = (unsigned int)(ceilf(-logf(1.f - cloudCover) * float(size) * float(size) / meanArea));
+    parameters.seed = size;
+    return SyntheticScene::Generate(parameters);
+}
+
+// Shared between benchmarks, generating the larger scenes dominates otherwise
+const Scene &CachedScene(int size, int coverPercent) {
+    static std::map<std::pair<int, int>, Scene> scenes;
+    auto it = scenes.find({size, coverPercent});
+    if (it == scenes.end())
+        it = scenes.insert({{size, coverPercent}, GenerateScene(size, coverPercent / 100.f)})
+                 .first;
+    return it->second;
+}
+
+ComputeEnvironment::SceneContext &Compute() {
+    [[maybe_unused]] static bool initialized = (ComputeEnvironment::InitMainContext(), true);
+    static ComputeEnvironment::SceneContext context;
+    return context;
+}
+
+// Everything the later stages consume, computed once per scene
+struct Intermediates {
+    GenerateCloudMaskReturn cloudMask;
+    PartitionCloudMaskReturn partition;
+    PotentialShadowMaskGenerationReturn potentialShadow;
+    std::shared_ptr<VectorGrid> sunGrid, viewGrid;
+    glm::vec3 sunPosition, viewPosition;
+    MatchCloudsShadowsResults matching;
+    std::shared_ptr<ImageFloat> alpha, beta;
+};
+
+const Intermediates &CachedIntermediates(int size, int coverPercent) {
+    static std::map<std::pair<int, int>, Intermediates> results;
+    auto it = results.find({size, coverPercent});
+    if (it != results.end()) return it->second;
+    const Scene &s = CachedScene(size, coverPercent);
+    Intermediates r;
+    r.cloudMask       = GenerateCloudMask(s.CLP, s.CLD, s.SCL, Compute());
+    r.partition       = PartitionCloudMask(r.cloudMask.cloudMask, s.diagonal, 3);
+    r.potentialShadow = GeneratePotentialShadowMask(s.NIR, r.cloudMask.cloudMask, s.SCL, Compute());
+    r.sunGrid         = GenerateVectorGridFromDegrees(s.SunZenith, s.SunAzimuth);
+    r.viewGrid        = GenerateVectorGridFromDegrees(s.ViewZenith, s.ViewAzimuth);
+    r.sunPosition     = LSPointEqualTo(r.sunGrid, s.diagonal, DistanceToSun).p;
+    r.viewPosition    = LSPointEqualTo(r.viewGrid, s.diagonal, DistanceToView).p;
+    r.matching        = MatchCloudsShadows(
+        r.partition.clouds,
+        r.partition.map,
+        r.cloudMask.cloudMask,
+        r.potentialShadow.mask,
+        s.diagonal,
+        r.sunPosition,
+        r.viewPosition
+    );
+    r.alpha = r.potentialShadow.alpha;
+    r.beta  = BetaMap(
+        r.matching.shadows,
+        r.matching.solutions,
+        r.cloudMask.cloudMask,
+        r.matching.shadowMask,
+        r.cloudMask.blendedCloudProbability,
+        s.diagonal
+    );
+    return results.insert({{size, coverPercent}, r}).first->second;
+}
+
+void SetPixelsProcessed(benchmark::State &state) {
+    state.SetItemsProcessed(int64_t(state.iterations()) * state.range(0) * state.range(0));
+    state.counters["pixels"] = double(state.range(0) * state.range(0));
+}
+
+// Sizes are the side length in pixels, densities the percentage of cloud cover
+void SizeArgs(benchmark::internal::Benchmark *b) {
+    for (int size : {256, 512, 1024, 2048})
+        b->Args({size, 20});
+    b->ArgNames({"size", "cover"});
+}
+void SizeAndCoverArgs(benchmark::internal::Benchmark *b) {
+    for (int size : {256, 512, 1024})
+        for (int cover : {5, 20, 40})
+            b->Args({size, cover});
+    b->ArgNames({"size", "cover"});
+}
+
+// Sums the image pixel by pixel through at(), the access pattern of the per-pixel loops
+void BM_PixelAccess(benchmark::State &state) {
+    const Scene &s        = CachedScene(int(state.range(0)), int(state.range(1)));
+    const ImageFloat &CLP = *s.CLP;
+    for (auto _ : state) {
+        float sum = 0.f;
+        for (unsigned int j = 0; j < CLP.rows(); j++)
+            for (unsigned int i = 0; i < CLP.cols(); i++)
+                sum += at(CLP, i, j);
+        benchmark::DoNotOptimize(sum);
+    }
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_PixelAccess)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+// The same with the owning shared_ptr copied per pixel, as the helpers took it by value
+void BM_PixelAccessSharedPtr(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    auto owned_at  = [](std::shared_ptr<ImageFloat> A, size_t i, size_t j) { return at(*A, i, j); };
+    for (auto _ : state) {
+        float sum = 0.f;
+        for (unsigned int j = 0; j < s.CLP->rows(); j++)
+            for (unsigned int i = 0; i < s.CLP->cols(); i++)
+                sum += owned_at(s.CLP, i, j);
+        benchmark::DoNotOptimize(sum);
+    }
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_PixelAccessSharedPtr)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_GaussianBlurFilter(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            GaussianBlur::GaussianBlurFilter(Compute().gaussianBlur, s.CLP, 4.f)
+        );
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_GaussianBlurFilter)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_PitFillAlgorithmFilter(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+            PitFillAlgorithm::PitFillAlgorithmFilter(Compute().pitFill, s.NIR, .35f)
+        );
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_PitFillAlgorithmFilter)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_PartitionCloudMask(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(PartitionCloudMask(r.cloudMask.cloudMask, s.diagonal, 3));
+    state.counters["clouds"] = double(r.partition.clouds.size());
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_PartitionCloudMask)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_MatchCloudsShadows(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(MatchCloudsShadows(
+            r.partition.clouds,
+            r.partition.map,
+            r.cloudMask.cloudMask,
+            r.potentialShadow.mask,
+            s.diagonal,
+            r.sunPosition,
+            r.viewPosition
+        ));
+    }
+    state.counters["clouds"]    = double(r.partition.clouds.size());
+    state.counters["evaluated"] = double(r.matching.evaluatedHeights);
+    state.counters["pruned"]    = double(r.matching.prunedHeights);
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_MatchCloudsShadows)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_MatchCloudsShadowsCL(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(MatchCloudsShadows(
+            Compute().matching,
+            r.partition.clouds,
+            r.partition.map,
+            r.cloudMask.cloudMask,
+            r.potentialShadow.mask,
+            s.diagonal,
+            r.sunPosition,
+            r.viewPosition
+        ));
+    }
+    state.counters["clouds"] = double(r.partition.clouds.size());
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_MatchCloudsShadowsCL)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_LSPointEqualTo(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(LSPointEqualTo(r.sunGrid, s.diagonal, DistanceToSun));
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_LSPointEqualTo)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_BetaMap(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(BetaMap(
+            r.matching.shadows,
+            r.matching.solutions,
+            r.cloudMask.cloudMask,
+            r.matching.shadowMask,
+            r.cloudMask.blendedCloudProbability,
+            s.diagonal
+        ));
+    }
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_BetaMap)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_ProbabilityMap(benchmark::State &state) {
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(ProbabilityMap(r.matching.shadowMask, r.alpha, r.beta));
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_ProbabilityMap)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+void BM_Evaluate(benchmark::State &state) {
+    const Scene &s         = CachedScene(int(state.range(0)), int(state.range(1)));
+    const Intermediates &r = CachedIntermediates(int(state.range(0)), int(state.range(1)));
+    ImageBounds bounds     = CastedImageBounds(
+        r.potentialShadow.mask,
+        s.diagonal,
+        r.sunPosition,
+        r.viewPosition,
+        r.matching.trimmedMeanHeight
+    );
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(
+            Evaluate(r.matching.shadowMask, r.cloudMask.cloudMask, s.shadowBaseline, bounds)
+        );
+    }
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_Evaluate)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+// Whole pipeline as the main executable runs it, minus reading and writing
+void BM_Pipeline(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    for (auto _ : state) {
+        auto cm  = GenerateCloudMask(s.CLP, s.CLD, s.SCL, Compute());
+        auto pcm = PartitionCloudMask(cm.cloudMask, s.diagonal, 3);
+        auto psm = GeneratePotentialShadowMask(s.NIR, cm.cloudMask, s.SCL, Compute());
+        auto grids
+            = GenerateSunViewVectorGrids(s.SunZenith, s.SunAzimuth, s.ViewZenith, s.ViewAzimuth);
+        auto sun  = LSPointEqualTo(grids.sun, s.diagonal, DistanceToSun);
+        auto view = LSPointEqualTo(grids.view, s.diagonal, DistanceToView);
+        auto osm  = MatchCloudsShadows(
+            pcm.clouds,
+            pcm.map,
+            cm.cloudMask,
+            psm.mask,
+            s.diagonal,
+            sun.p,
+            view.p
+        );
+        auto alpha = psm.alpha;
+        auto beta  = BetaMap(
+            osm.shadows,
+            osm.solutions,
+            cm.cloudMask,
+            osm.shadowMask,
+            cm.blendedCloudProbability,
+            s.diagonal
+        );
+        auto surface = ProbabilityMap(osm.shadowMask, alpha, beta);
+        benchmark::DoNotOptimize(
+            ImprovedShadowMask(osm.shadowMask, cm.cloudMask, alpha, beta, surface, .15f)
+        );
+    }
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_Pipeline)->Apply(SizeAndCoverArgs)->Unit(benchmark::kMillisecond);
+
+Path BenchmarkFile(const std::string &name) {
+    Path dir = std::filesystem::temp_directory_path() / "Cloud-Shadow-Detection" / "benchmarks";
+    std::filesystem::create_directories(dir);
+    return dir / name;
+}
+
+void BM_WriteSingleChannelFloat(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path      = BenchmarkFile("float.tif");
+    for (auto _ : state)
+        Imageio::WriteSingleChannelFloat(path, s.NIR);
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_WriteSingleChannelFloat)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_ReadSingleChannelFloat(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path      = BenchmarkFile("float.tif");
+    Imageio::WriteSingleChannelFloat(path, s.NIR);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(Imageio::ReadSingleChannelFloat(path));
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_ReadSingleChannelFloat)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_WriteSingleChannelUint16(benchmark::State &state) {
+    const Scene &s                  = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path                       = BenchmarkFile("uint16.tif");
+    std::shared_ptr<ImageUint> data = std::make_shared<ImageUint>(
+        (s.NIR->array() * float(std::numeric_limits<uint16_t>::max())).cast<unsigned int>()
+    );
+    for (auto _ : state)
+        Imageio::WriteSingleChannelUint16(path, data);
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_WriteSingleChannelUint16)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_ReadSingleChannelUint16(benchmark::State &state) {
+    const Scene &s                  = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path                       = BenchmarkFile("uint16.tif");
+    std::shared_ptr<ImageUint> data = std::make_shared<ImageUint>(
+        (s.NIR->array() * float(std::numeric_limits<uint16_t>::max())).cast<unsigned int>()
+    );
+    Imageio::WriteSingleChannelUint16(path, data);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(Imageio::ReadSingleChannelUint16(path));
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_ReadSingleChannelUint16)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_WriteRGBA(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path      = BenchmarkFile("rgba.tif");
+    std::shared_ptr<ImageUint> data = SceneClassificationLayer::GenerateRGBA(s.SCL);
+    for (auto _ : state)
+        Imageio::WriteRGBA(path, data);
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_WriteRGBA)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+
+void BM_ReadRGBA(benchmark::State &state) {
+    const Scene &s = CachedScene(int(state.range(0)), int(state.range(1)));
+    Path path      = BenchmarkFile("rgba.tif");
+    Imageio::WriteRGBA(path, SceneClassificationLayer::GenerateRGBA(s.SCL));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(Imageio::ReadRGBA(path));
+    SetPixelsProcessed(state);
+}
+BENCHMARK(BM_ReadRGBA)->Apply(SizeArgs)->Unit(benchmark::kMillisecond);
+}  // namespace
+
+int main(int argc, char **argv) {
+    Imageio::SupressLibTIFF();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return EXIT_FAILURE;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return EXIT_SUCCESS;
+}
@@ -18,11 +18,13 @@
 // ---- Project Files ---- //
 #include "CloudMask.h"
 #include "CloudShadowMatching.h"
+#include "ComputeContext.h"
 #include "ComputeEnvironment.h"
 #include "Functions.h"
 #include "GUI.h"
 #include "GaussianBlur.h"
 #include "ImageOperations.h"
+#include "ImagePool.h"
 #include "Imageio.h"
 #include "PitFillAlgorithm.h"
 #include "PotentialShadowMask.h"
@@ -58,11 +60,43 @@ int main(int argc, char **argv) {
     Path data_path;
     Path output_path;
     bool use_gui = false;
+    Path kernel_cache_path;
+    bool no_kernel_cache = false;
+    ComputeEnvironment::DeviceSelection device_selection;
+    unsigned int geometry_stride = 1u;
+    bool geometry_stride_check   = false;
+    bool device_matching         = false;
 
     // Define the command line parser
     cli cli = help(help_) | opt(data_path, "data_path")["--data_path"]("Input Specs TOML file")
         | opt(output_path, "output_path")["--output_path"]("Output Specs TOML file")
-        | opt(use_gui)["-g"]("Run the GUI");
+        | opt(use_gui)["-g"]("Run the GUI")
+        | opt(kernel_cache_path, "kernel_cache_path")["--kernel_cache_path"](
+              "Directory of the compiled OpenCL program cache"
+        )
+        | opt(no_kernel_cache)["--no_kernel_cache"]("Always compile OpenCL programs from source")
+        | opt(device_selection.platform, "platform")["--platform"](
+              "OpenCL platform index or name"
+        )
+        | opt(device_selection.device, "device")["--device"]("OpenCL device index or name")
+        | opt(device_selection.type, "device_type")["--device_type"](
+              "OpenCL device type: all, gpu, cpu or accelerator"
+        )
+        | opt(device_selection.subDevices, "sub_devices")["--sub_devices"](
+              "Split each CPU device into this many sub-devices"
+        )
+        | opt(geometry_stride, "geometry_stride")["--geometry_stride"](
+              "Sample every n-th angle pixel when solving the sun and view positions, 0 for the "
+              "5 km angle grid, no bound on the error is given unless --geometry_stride_check"
+        )
+        | opt(geometry_stride_check)["--geometry_stride_check"](
+              "Also solve the positions from every angle pixel and report how far the sampled "
+              "solve is from it"
+        )
+        | opt(device_matching)["--device_matching"](
+              "Sweep every cloud height on the OpenCL device instead of the pruned host sweep "
+              "(experimental)"
+        );
 
     std::ostringstream helpMessage;
     helpMessage << cli;
@@ -502,9 +536,16 @@ int main(int argc, char **argv) {
 
     Log::debug("Initizing Computing Context...");
 
-    ComputeEnvironment::InitMainContext();
-    GaussianBlur::init();
-    PitFillAlgorithm::init();
+    if (no_kernel_cache) ComputeEnvironment::SetProgramCacheDirectory(Path());
+    else if (!kernel_cache_path.empty())
+        ComputeEnvironment::SetProgramCacheDirectory(kernel_cache_path);
+    try {
+        ComputeEnvironment::InitMainContext(device_selection);
+    } catch (std::exception &e) {
+        Log::error("Failed to initialize the compute context: {}", e.what());
+        return EXIT_FAILURE;
+    }
+    ComputeEnvironment::SceneContext compute;
 
     Log::debug("Running Algorithm...");
 
@@ -518,7 +559,7 @@ int main(int argc, char **argv) {
     Log::debug(" --- Cloud Detection...");
     // Generate the Cloud mask along with the intermediate result of the blended cloud probability
     GenerateCloudMaskReturn GenerateCloudMask_Return
-        = GenerateCloudMask(data_CLP, data_CLD, data_SCL);
+        = GenerateCloudMask(data_CLP, data_CLD, data_SCL, compute);
     std::shared_ptr<ImageFloat> &BlendedCloudProbability
         = GenerateCloudMask_Return.blendedCloudProbability;
     std::shared_ptr<ImageBool> &output_CM = GenerateCloudMask_Return.cloudMask;
@@ -533,41 +574,95 @@ int main(int argc, char **argv) {
     Log::debug(" --- Potential Shadow Mask Generation...");
     // Generate the Candidate (or Potential) Shadow Mask
     PotentialShadowMaskGenerationReturn GeneratePotentialShadowMask_Return
-        = GeneratePotentialShadowMask(data_NIR, output_CM, data_SCL);
+        = GeneratePotentialShadowMask(data_NIR, output_CM, data_SCL, compute);
     std::shared_ptr<ImageBool> output_PSM = GeneratePotentialShadowMask_Return.mask;
-    std::shared_ptr<ImageFloat> DeltaNIR
-        = GeneratePotentialShadowMask_Return.difference_of_pitfill_NIR;
+    std::shared_ptr<ImageFloat> output_Alpha = GeneratePotentialShadowMask_Return.alpha;
 
     Log::debug(" --- Solving for Sun and Satillite Position...");
-    // Generate a Vector grid for each
-    std::shared_ptr<VectorGrid> SunVectorGrid
-        = GenerateVectorGrid(toRadians(data_SunZenith), toRadians(data_SunAzimuth));
-    std::shared_ptr<VectorGrid> ViewVectorGrid
-        = GenerateVectorGrid(toRadians(data_ViewZenith), toRadians(data_ViewAzimuth));
-    LMSPointReturn SunLSPointEqualTo_Return
-        = LSPointEqualTo(SunVectorGrid, data_diagonal_distance, DistanceToSun);
+    unsigned int SunStride = geometry_stride > 0u
+        ? geometry_stride
+        : NativeStride(data_SunZenith, data_diagonal_distance);
+    unsigned int ViewStride = geometry_stride > 0u
+        ? geometry_stride
+        : NativeStride(data_ViewZenith, data_diagonal_distance);
+    // Generate a Vector grid for each, only the sampled pixels unless the GUI draws the whole grids
+    // or the check solves from them. The bands share a shape so the strides agree
+    bool full_grids                = use_gui || geometry_stride_check;
+    SunViewVectorGrids VectorGrids = GenerateSunViewVectorGrids(
+        data_SunZenith,
+        data_SunAzimuth,
+        data_ViewZenith,
+        data_ViewAzimuth,
+        full_grids ? 1u : SunStride
+    );
+    std::shared_ptr<VectorGrid> SunVectorGrid  = VectorGrids.sun;
+    std::shared_ptr<VectorGrid> ViewVectorGrid = VectorGrids.view;
+    LMSPointReturn SunLSPointEqualTo_Return    = LSPointEqualTo(
+        GetLSSystem(SunVectorGrid, data_diagonal_distance, SunStride), DistanceToSun
+    );
     glm::vec3 &SunPosition = SunLSPointEqualTo_Return.p;
-    LMSPointReturn ViewLSPointEqualTo_Return
-        = LSPointEqualTo(ViewVectorGrid, data_diagonal_distance, DistanceToView);
+    LMSPointReturn ViewLSPointEqualTo_Return = LSPointEqualTo(
+        GetLSSystem(ViewVectorGrid, data_diagonal_distance, ViewStride), DistanceToView
+    );
     glm::vec3 &ViewPosition = ViewLSPointEqualTo_Return.p;
-    float output_MDPSun     = AverageDotProduct(SunVectorGrid, data_diagonal_distance, SunPosition);
-    float output_MDPView = AverageDotProduct(ViewVectorGrid, data_diagonal_distance, ViewPosition);
+    // Distance to the positions solved from every pixel, only with the check, otherwise nothing
+    // bounds the error of subsampling
+    bool stride_check    = geometry_stride_check && (SunStride > 1u || ViewStride > 1u);
+    float SunStrideError = stride_check
+        ? glm::distance(
+              SunPosition,
+              LSPointEqualTo(GetLSSystem(SunVectorGrid, data_diagonal_distance), DistanceToSun).p
+          )
+        : 0.f;
+    float ViewStrideError = stride_check
+        ? glm::distance(
+              ViewPosition,
+              LSPointEqualTo(GetLSSystem(ViewVectorGrid, data_diagonal_distance), DistanceToView)
+                  .p
+          )
+        : 0.f;
+    float output_MDPSun
+        = AverageDotProducts(SunVectorGrid, data_diagonal_distance, {SunPosition}, SunStride)[0];
+    float output_MDPView
+        = AverageDotProducts(ViewVectorGrid, data_diagonal_distance, {ViewPosition}, ViewStride)[0];
 
     Log::debug(" --- Object-based Shadow Mask Generation...");
     // Solve for the optimal shadow matching results per cloud
-    MatchCloudsShadowsResults MatchCloudsShadows_Return = MatchCloudsShadows(
-        Clouds, CloudsMap, output_CM, output_PSM, data_diagonal_distance, SunPosition, ViewPosition
-    );
-    std::map<int, OptimalSolution> &OptimalCloudCastingSolutions
+    MatchCloudsShadowsResults MatchCloudsShadows_Return = device_matching
+        ? MatchCloudsShadows(
+              compute.matching,
+              Clouds,
+              CloudsMap,
+              output_CM,
+              output_PSM,
+              data_diagonal_distance,
+              SunPosition,
+              ViewPosition
+          )
+        : MatchCloudsShadows(
+              Clouds,
+              CloudsMap,
+              output_CM,
+              output_PSM,
+              data_diagonal_distance,
+              SunPosition,
+              ViewPosition
+          );
+    std::vector<OptimalSolution> &OptimalCloudCastingSolutions
         = MatchCloudsShadows_Return.solutions;
     ShadowQuads &CloudCastedShadows        = MatchCloudsShadows_Return.shadows;
     std::shared_ptr<ImageBool> &output_OSM = MatchCloudsShadows_Return.shadowMask;
     float &TrimmedMeanCloudHeight          = MatchCloudsShadows_Return.trimmedMeanHeight;
+    Log::debug(
+        "Heights evaluated: {}, pruned: {}{}",
+        MatchCloudsShadows_Return.evaluatedHeights,
+        MatchCloudsShadows_Return.prunedHeights,
+        MatchCloudsShadows_Return.onDevice ? " (on the device, which does not prune)" : ""
+    );
 
     Log::debug(" --- Generating Probability Function...");
-    // Generate the Alpha and Beta maps to produce the probability surface
-    std::shared_ptr<ImageFloat> output_Alpha = ProbabilityRefinement::AlphaMap(DeltaNIR);
-    std::shared_ptr<ImageFloat> output_Beta  = ProbabilityRefinement::BetaMap(
+    // The Alpha map came with the potential shadow mask, generate the Beta map for the surface
+    std::shared_ptr<ImageFloat> output_Beta = ProbabilityRefinement::BetaMap(
         CloudCastedShadows,
         OptimalCloudCastingSolutions,
         output_CM,
@@ -588,6 +683,8 @@ int main(int argc, char **argv) {
         ProbabilityFunctionThreshold
     );
     Log::debug("...Finished Algorithm.");
+    Log::info("Compute device throughput:{}", ComputeEnvironment::ThroughputReport());
+    Log::info("Image pool: {}", ImagePool::Report(compute.images.Stats()));
     Log::debug("Evaluating data...");
     ImageBounds output_EvaluationBounds = CastedImageBounds(
         output_PSM, data_diagonal_distance, SunPosition, ViewPosition, TrimmedMeanCloudHeight
@@ -659,6 +756,39 @@ int main(int argc, char **argv) {
         evaluation_json["Bounds"]["y"]["min"]          = output_EvaluationBounds.p0.y;
         evaluation_json["Bounds"]["y"]["max"]          = output_EvaluationBounds.p1.y;
 
+        evaluation_json["Sun"]["Stride"]  = SunStride;
+        evaluation_json["View"]["Stride"] = ViewStride;
+        if (stride_check) {
+            evaluation_json["Sun"]["Position Stride Error"]  = SunStrideError;
+            evaluation_json["View"]["Position Stride Error"] = ViewStrideError;
+        }
+
+        evaluation_json["Sun"]["Position"]  = {SunPosition.x, SunPosition.y, SunPosition.z};
+        evaluation_json["View"]["Position"] = {ViewPosition.x, ViewPosition.y, ViewPosition.z};
+
+        evaluation_json["Cloud Shadow Matching"]["Evaluated Heights"]
+            = MatchCloudsShadows_Return.evaluatedHeights;
+        evaluation_json["Cloud Shadow Matching"]["Pruned Heights"]
+            = MatchCloudsShadows_Return.prunedHeights;
+        // The device sweeps every height, so it never prunes
+        evaluation_json["Cloud Shadow Matching"]["On Device"] = MatchCloudsShadows_Return.onDevice;
+
+        for (auto &device : ComputeEnvironment::Throughput()) {
+            evaluation_json["Compute Devices"].push_back(
+                {{"Name", device.name},
+                 {"Jobs", device.jobs},
+                 {"Pixels", device.pixels},
+                 {"Seconds", device.seconds},
+                 {"MPixels Per Second", device.megaPixelsPerSecond()}}
+            );
+        }
+
+        ImagePool::Statistics pool                       = compute.images.Stats();
+        evaluation_json["Image Pool"]["Allocations"]     = pool.allocations;
+        evaluation_json["Image Pool"]["Reuses"]          = pool.reuses;
+        evaluation_json["Image Pool"]["Peak Live Bytes"] = pool.peakLiveBytes;
+        evaluation_json["Image Pool"]["Peak Held Bytes"] = pool.peakHeldBytes;
+
         evaluation_json["Potential Shadow Mask"]["Users Accuracy"] = PSM_results.users_accuracy;
         evaluation_json["Potential Shadow Mask"]["Producers Accuracy"]
             = PSM_results.producers_accuracy;
@@ -715,7 +845,7 @@ int main(int argc, char **argv) {
     // Will perform a render loop in custom viewer
     if (use_gui) {
         Log::debug("Booting up GUI...");
-        auto side_lengths = ImageOperations::sides<float>(data_NIR, data_diagonal_distance);
+        auto side_lengths = ImageOperations::sides(*data_NIR, data_diagonal_distance);
         float major_i     = float(std::max(data_NIR->rows(), data_NIR->cols()));
         float major_v     = std::max(side_lengths.x, side_lengths.y);
         glm::mat4 center
@@ -808,6 +938,10 @@ int main(int argc, char **argv) {
         gui->registerView("Generated Sun Vector Grid");
         glm::vec3 ave_sun_dir = AverageDirection(SunVectorGrid);
 
+        // The viewer reads the grids as interleaved vec3 buffers
+        std::vector<glm::vec3> SunVectors  = SunVectorGrid->interleaved();
+        std::vector<glm::vec3> ViewVectors = ViewVectorGrid->interleaved();
+
         const int deltaVectorGrid = 32;
         sun_view_geom->setVerts({SunPosition, ViewPosition});
         std::vector<glm::ivec3> vector_grid(deltaVectorGrid * deltaVectorGrid);
@@ -1104,7 +1238,7 @@ int main(int argc, char **argv) {
 
                 if (Functions::equal(current_image, "Generated Sun Vector Grid")) {
                     main_viewer_ssbo->uploadData(
-                        data_Size * sizeof(glm::vec3), SunVectorGrid->data(), GL_STATIC_DRAW
+                        data_Size * sizeof(glm::vec3), SunVectors.data(), GL_STATIC_DRAW
                     );
                     glEnable(GL_DEPTH_TEST);
                     glDisable(GL_BLEND);
@@ -1142,7 +1276,7 @@ int main(int argc, char **argv) {
 
                 if (Functions::equal(current_image, "Generated View Vector Grid")) {
                     main_viewer_ssbo->uploadData(
-                        data_Size * sizeof(glm::vec3), ViewVectorGrid->data(), GL_STATIC_DRAW
+                        data_Size * sizeof(glm::vec3), ViewVectors.data(), GL_STATIC_DRAW
                     );
                     glEnable(GL_DEPTH_TEST);
                     glDisable(GL_BLEND);
@@ -1196,11 +1330,11 @@ int main(int argc, char **argv) {
                     BasicShaderProgram->setMat4(
                         glm::scale(glm::mat4(1.f), glm::vec3(1., -1., 1.)) * vector_model, "M"
                     );
-                    for (auto &c : Clouds) {
-                        if (c.second.pixels.list.size() < quad_cull_bounds.x
-                            || c.second.pixels.list.size() > quad_cull_bounds.y)
+                    for (size_t k = 0; k < Clouds.size(); k++) {
+                        if (Clouds.area(k) < quad_cull_bounds.x
+                            || Clouds.area(k) > quad_cull_bounds.y)
                             continue;
-                        Quad render_quad = c.second.quad;
+                        Quad render_quad = Clouds.quads[k];
                         bool mouse_in    = Functions::inXY(render_quad, mouse_pos_vector_space);
 
                         line_geom->setVerts(render_quad.lineStrip());
@@ -1208,9 +1342,9 @@ int main(int argc, char **argv) {
                         line_geom->bind();
                         glDrawArrays(GL_LINE_STRIP, 0, 5);
 
-                        if (OptimalCloudCastingSolutions[c.first].similarity > 0.f) {
+                        if (OptimalCloudCastingSolutions[k].similarity > 0.f) {
                             // Casted Cloud
-                            render_quad.apply(OptimalCloudCastingSolutions[c.first].M);
+                            render_quad.apply(OptimalCloudCastingSolutions[k].M);
                             line_geom->setVerts(render_quad.lineStrip());
                             BasicShaderProgram->setVec4(
                                 {.3f, mouse_in ? 0.f : 1.f, .7f, 1.f}, "col"
@@ -1219,7 +1353,7 @@ int main(int argc, char **argv) {
                             glDrawArrays(GL_LINE_STRIP, 0, 5);
 
                             //// Shadow Quad
-                            // render_quad = CastingShadowMask.shadows[c.first].quad;
+                            // render_quad = CastingShadowMask.shadows.quads[k];
                             // line_geom.setVerts(render_quad.lineStrip());
                             // BasicProgram->setVec4({ 0.f, mouse_in ? 1.f : 0.f, 1.f, 1.f },
                             // "col"); line_geom.bind(); glDrawArrays(GL_LINE_STRIP, 0, 5);
@@ -198,24 +198,25 @@ int main(int argc, char **argv) {
     const float DistanceToViewEnd   = 2000.f;
 
     std::shared_ptr<VectorGrid> ViewVectorGrid
-        = GenerateVectorGrid(toRadians(data_ViewZenith), toRadians(data_ViewAzimuth));
+        = GenerateVectorGridFromDegrees(data_ViewZenith, data_ViewAzimuth);
     struct Element {
         float h;
         float d;
         glm::vec3 pos;
     };
-    Element temp;
     std::vector<Element> series;
-    LMSPointReturn lmsresult;
-    series.reserve((DistanceToViewEnd - DistanceToViewStart) / DistanceToViewDelta);
+    series.reserve((DistanceToViewEnd - DistanceToViewStart) / DistanceToViewDelta + 1);
+    // The system does not depend on the height, so it is built once and solved per height
+    LSSystem ViewSystem = GetLSSystem(ViewVectorGrid, data_diagonal_distance);
+    std::vector<glm::vec3> positions;
     for (float h = DistanceToViewStart; h <= DistanceToViewEnd; h += DistanceToViewDelta) {
-        temp.h    = h;
-        lmsresult = LSPointEqualTo(ViewVectorGrid, data_diagonal_distance, h);
-        temp.pos  = lmsresult.p;
-        temp.d    = AverageDotProduct(ViewVectorGrid, data_diagonal_distance, lmsresult.p);
-        series.push_back(temp);
-        Log::debug("Done at height: {}", h);
+        series.push_back({h, 0.f, LSPointEqualTo(ViewSystem, h).p});
+        positions.push_back(series.back().pos);
     }
+    std::vector<float> dots = AverageDotProducts(ViewVectorGrid, data_diagonal_distance, positions);
+    for (size_t i = 0; i < series.size(); i++)
+        series[i].d = dots[i];
+    Log::debug("Done for {} heights", series.size());
 
     Log::debug("Finished Computing...Writting the output...");
 
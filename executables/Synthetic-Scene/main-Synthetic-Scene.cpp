@@ -0,0 +1,90 @@
+#include <string>
+
+#include <lyra/lyra.hpp>
+
+#include "Imageio.h"
+#include "SyntheticScene.h"
+#include "boilerplate/Log.h"
+#include "types.h"
+
+using namespace lyra;
+
+int main(int argc, char **argv) {
+    Log::debug("Program Started...");
+    bool help_ = false;
+    Path output_path;
+    std::string id = "Synthetic";
+    SyntheticScene::Parameters parameters;
+
+    // Define the command line parser
+    cli cli = help(help_)
+        | opt(output_path, "output_path")["--output_path"](
+              "Directory to write the bands and TOML to"
+        )
+        | opt(id, "id")["--id"]("ID written to the data TOML")
+        | opt(parameters.size, "size")["--size"]("Side length of the scene in pixels")
+        | opt(parameters.pixelSize, "pixel_size")["--pixel_size"]("Side length of a pixel in km")
+        | opt(parameters.cloudCount, "cloud_count")["--cloud_count"]("Number of clouds")
+        | opt(parameters.cloudRadius.x, "min_cloud_radius")["--min_cloud_radius"](
+              "Smallest cloud radius in pixels"
+        )
+        | opt(parameters.cloudRadius.y, "max_cloud_radius")["--max_cloud_radius"](
+              "Largest cloud radius in pixels"
+        )
+        | opt(parameters.cloudHeight.x, "min_cloud_height")["--min_cloud_height"](
+              "Lowest cloud height in km"
+        )
+        | opt(parameters.cloudHeight.y, "max_cloud_height")["--max_cloud_height"](
+              "Highest cloud height in km"
+        )
+        | opt(parameters.sunZenith, "sun_zenith")["--sun_zenith"]("Sun zenith angle in degrees")
+        | opt(parameters.sunAzimuth, "sun_azimuth")["--sun_azimuth"]("Sun azimuth angle in degrees")
+        | opt(parameters.viewZenith, "view_zenith")["--view_zenith"](
+              "View zenith angle in degrees"
+        )
+        | opt(parameters.viewAzimuth, "view_azimuth")["--view_azimuth"](
+              "View azimuth angle in degrees"
+        )
+        | opt(parameters.seed, "seed")["--seed"]("Random seed, equal seeds give equal scenes");
+
+    std::ostringstream helpMessage;
+    helpMessage << cli;
+
+    Log::debug("Parsing CLI...");
+    parse_result result = cli.parse({argc, argv});
+
+    if (!result) {
+        Log::error("Error in command line: {}", result.message());
+        Log::error("CLI: {}", helpMessage.str());
+        return EXIT_FAILURE;
+    }
+    if (help_) {
+        Log::info("CLI: {}", helpMessage.str());
+        return EXIT_SUCCESS;
+    }
+    if (output_path.empty()) {
+        Log::error("No output path provided");
+        Log::error("CLI: {}", helpMessage.str());
+        return EXIT_FAILURE;
+    }
+    if (parameters.size == 0u || parameters.cloudRadius.x > parameters.cloudRadius.y
+        || parameters.cloudHeight.x > parameters.cloudHeight.y) {
+        Log::error("Invalid scene parameters");
+        return EXIT_FAILURE;
+    }
+
+    Imageio::SupressLibTIFF();
+
+    Log::debug("Generating Scene...");
+    SyntheticScene::Scene scene = SyntheticScene::Generate(parameters);
+
+    Log::debug("Writing Scene...");
+    try {
+        Path data_path = SyntheticScene::Write(scene, output_path, id);
+        Log::info("Wrote synthetic scene: {}", data_path.string());
+    } catch (std::exception &e) {
+        Log::error("Failed to write the synthetic scene: {}", e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
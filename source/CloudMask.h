@@ -1,4 +1,5 @@
 #pragma once
+#include "ComputeContext.h"
 #include "types.h"
 
 namespace CloudMask {
@@ -9,7 +10,8 @@ struct GenerateCloudMaskReturn {
 GenerateCloudMaskReturn GenerateCloudMask(
     std::shared_ptr<ImageFloat> CLP,
     std::shared_ptr<ImageFloat> CLD,
-    std::shared_ptr<ImageUint> SCL
+    std::shared_ptr<ImageUint> SCL,
+    ComputeEnvironment::SceneContext &compute
 );
 struct PartitionCloudMaskReturn {
     CloudQuads clouds;
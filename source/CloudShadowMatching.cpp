@@ -1,177 +1,340 @@
 #include "CloudShadowMatching.h"
 
+#include <bit>
+#include <chrono>
+
+#include <boost/compute/algorithm/copy.hpp>
+#include <boost/compute/algorithm/copy_n.hpp>
+#include <boost/compute/utility/source.hpp>
+
+#include "ComputeEnvironment.h"
 #include "Functions.h"
 #include "ImageOperations.h"
+#include "ImagePool.h"
+#include "boilerplate/Log.h"
 
+using namespace boost::compute;
+using namespace ComputeEnvironment;
 using namespace ImageOperations;
 namespace CloudShadowMatching {
+// A match must be at least this similar to count
+static const float MinimumSimilarity = .3f;
+
+// Bit packed masks every cloud is scored against
+struct __Bitmaps__ {
+    BitImage cloudFree;   // Not cloud
+    BitImage candidates;  // Potential shadow that is not cloud
+};
+// Cloud k's pixels within its bounds
+BitImage __Footprint__(const CloudQuads &clouds, size_t k) {
+    const ImageBounds &bounds = clouds.bounds[k];
+    BitImage ret(bounds.p1.x - bounds.p0.x + 1, bounds.p1.y - bounds.p0.y + 1);
+    for (auto &run : clouds.list(k))
+        for (unsigned int i = run.i0; i <= run.i1; i++)
+            ret.set(i - bounds.p0.x, run.j - bounds.p0.y);
+    return ret;
+}
+
+// Heights swept for every cloud, in km
+std::vector<float> __Heights__() {
+    std::vector<float> ret;
+    for (float height = .2f; height <= 12.f; height += .025f)
+        ret.push_back(height);
+    return ret;
+}
+// Ground transform of the cloud's shadow were the cloud at this height
+glm::mat4 __Transform__(const Quad &cloud, float height, glm::vec3 sunPos, glm::vec3 viewPos) {
+    Plane height_plane({0.f, 0.f, height}, {0.f, 0.f, 1.f});
+    Plane ground_plane({0.f, 0.f, 0.f}, {0.f, 0.f, 1.f});
+    Quad casted = Functions::perspective(cloud, viewPos, height_plane);
+    casted      = Functions::perspective(casted, sunPos, ground_plane);
+    glm::mat4 M = Functions::affineTransform(cloud, casted);
+    M[2][2]     = 1.f;  // Make matrix invertable by leaving z direction identity
+    return M;
+}
+// Pixels of the shadow image the casted quad covers, clamped to the image
+ImageBounds __ShadowBox__(
+    const Quad &casted, std::shared_ptr<ImageBool> potentialShadow, float DiagonalLength
+) {
+    glm::ivec2 p00_shadow = index(*potentialShadow, DiagonalLength, casted.p00);
+    glm::ivec2 p01_shadow = index(*potentialShadow, DiagonalLength, casted.p01);
+    glm::ivec2 p10_shadow = index(*potentialShadow, DiagonalLength, casted.p10);
+    glm::ivec2 p11_shadow = index(*potentialShadow, DiagonalLength, casted.p11);
+    glm::ivec2 last = glm::ivec2(potentialShadow->cols(), potentialShadow->rows()) - 1;
+    glm::ivec2 p0   = glm::clamp(
+        glm::ivec2(
+            std::min({p00_shadow.x, p01_shadow.x, p10_shadow.x, p11_shadow.x}),
+            std::min({p00_shadow.y, p01_shadow.y, p10_shadow.y, p11_shadow.y})
+        ),
+        glm::ivec2(0),
+        last
+    );
+    glm::ivec2 p1 = glm::clamp(
+        glm::ivec2(
+            std::max({p00_shadow.x, p01_shadow.x, p10_shadow.x, p11_shadow.x}),
+            std::max({p00_shadow.y, p01_shadow.y, p10_shadow.y, p11_shadow.y})
+        ),
+        glm::ivec2(0),
+        last
+    );
+    return {glm::uvec2(p0), glm::uvec2(p1)};
+}
+
 struct __SimilarityComparision__Return {
     float similarity;
-    ShadowQuad shadow;
+    bool pruned;  // Stopped once it could no longer beat best or reach MinimumSimilarity
+};
+// Candidate pixels of a row within [span.x, span.y)
+unsigned int __Candidates__(const BitImage &candidates, int j, glm::ivec2 span) {
+    if (span.x >= span.y) return 0u;
+    const uint64_t *row = candidates.row(j);
+    int first = span.x >> 6, last = (span.y - 1) >> 6;
+    uint64_t head = ~uint64_t(0) << (span.x & 63);
+    uint64_t tail = ~uint64_t(0) >> (63 - ((span.y - 1) & 63));
+    if (first == last) return unsigned(std::popcount(row[first] & head & tail));
+    unsigned int ret = unsigned(std::popcount(row[first] & head) + std::popcount(row[last] & tail));
+    for (int w = first + 1; w < last; w++)
+        ret += unsigned(std::popcount(row[w]));
+    return ret;
+}
+// Marks the shadow pixels of row j within span whose mapped pixel is under the cloud
+void __Under__(
+    const AffinePixelMap &map,
+    const BitImage &footprint,
+    glm::ivec2 origin,
+    int j,
+    glm::ivec2 span,
+    uint64_t *under
+) {
+    int first = span.x >> 6, last = (span.y - 1) >> 6;
+    std::fill(under + first, under + last + 1, 0u);
+    glm::vec2 base = map(0, j);
+    for (int i = span.x; i < span.y; i++) {
+        int x    = int(floorf(base.x + float(i) * map.di.x)) - origin.x;
+        int y    = int(floorf(base.y + float(i) * map.di.y)) - origin.y;
+        bool hit = x >= 0 && x < int(footprint.width) && y >= 0 && y < int(footprint.height)
+                && footprint.at(x, y);
+        under[i >> 6] |= uint64_t(hit) << (i & 63);
+    }
+}
+// Buffers reused by every height of a cloud, so the sweep itself allocates nothing
+struct __Scratch__ {
+    std::vector<glm::ivec2> spans;  // Per row of the image
+    std::vector<uint64_t> under;    // One row of the bitmaps
 };
+// Counts only, the shadow itself is built by __CastShadow__ once the best transform is known
 __SimilarityComparision__Return __SimilarityComparision__(
-    CloudQuad cloud,
+    const CloudQuads &clouds,
+    size_t k,
+    const BitImage &footprint,
+    const __Bitmaps__ &bitmaps,
+    __Scratch__ &scratch,
     glm::mat4 M,
-    std::shared_ptr<ImageInt> cloudMap,
+    float best,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> potentialShadow,
     float DiagonalLength
 ) {
     __SimilarityComparision__Return ret;
-    ret.similarity              = -1.1f;
-    ret.shadow.quad             = M * cloud.quad;
-    ret.shadow.pixels.bounds.p0 = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-    ret.shadow.pixels.bounds.p1 = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-    ret.shadow.pixels.id        = cloud.pixels.id;
-
-    glm::mat4 M_inverse = glm::inverse(M);
+    ret.similarity = -1.1f;
+    ret.pruned     = false;
 
     unsigned int T = 0u;
     unsigned int C = 0u;
 
-    glm::ivec2 p00_shadow = index(potentialShadow, DiagonalLength, ret.shadow.quad.p00);
-    glm::ivec2 p01_shadow = index(potentialShadow, DiagonalLength, ret.shadow.quad.p01);
-    glm::ivec2 p10_shadow = index(potentialShadow, DiagonalLength, ret.shadow.quad.p10);
-    glm::ivec2 p11_shadow = index(potentialShadow, DiagonalLength, ret.shadow.quad.p11);
+    ImageBounds box = __ShadowBox__(M * clouds.quads[k], potentialShadow, DiagonalLength);
 
-    unsigned int min_x_in = std::clamp(
-        std::min({p00_shadow.x, p01_shadow.x, p10_shadow.x, p11_shadow.x}),
-        0,
-        int(potentialShadow->cols()) - 1
-    );
-    unsigned int min_y_in = std::clamp(
-        std::min({p00_shadow.y, p01_shadow.y, p10_shadow.y, p11_shadow.y}),
-        0,
-        int(potentialShadow->rows()) - 1
-    );
-    unsigned int max_x_in = std::clamp(
-        std::max({p00_shadow.x, p01_shadow.x, p10_shadow.x, p11_shadow.x}),
-        0,
-        int(potentialShadow->cols()) - 1
-    );
-    unsigned int max_y_in = std::clamp(
-        std::max({p00_shadow.y, p01_shadow.y, p10_shadow.y, p11_shadow.y}),
-        0,
-        int(potentialShadow->rows()) - 1
-    );
+    // The cloud pixels under each candidate shadow pixel, row by row over only the columns that
+    // can map into the cloud's bounds, then counted a word of pixels at a time
+    glm::mat4 M_inverse = glm::inverse(M);
+    AffinePixelMap map  = affinePixelMap(potentialShadow, cloudMask, DiagonalLength, M_inverse);
+    glm::ivec2 origin   = glm::ivec2(clouds.bounds[k].p0);
+
+    // Every candidate pixel left in the spans could at best add one to both C and T, so
+    // (C + R) / (T + R) bounds the final similarity, a height whose bound can neither beat the
+    // best so far nor reach MinimumSimilarity cannot change the optimum and is dropped. Spans
+    // mapping nowhere, such as a shadow cast off the image, leave nothing to count at all
+    std::vector<glm::ivec2> &spans = scratch.spans;
+    unsigned int R                 = 0u;
+    for (int j = int(box.p0.y); j <= int(box.p1.y); j++) {
+        glm::ivec2 &span = spans[j - int(box.p0.y)];
+        span = mappedSpan(map, j, clouds.bounds[k], int(box.p0.x), int(box.p1.x) + 1);
+        R += __Candidates__(bitmaps.candidates, j, span);
+    }
+    auto hopeless = [&]() {
+        if (T + R == 0u) return true;
+        float bound = float(C + R) / float(T + R);
+        return bound < MinimumSimilarity || bound <= best;
+    };
+    if (hopeless()) {
+        ret.pruned = true;
+        return ret;
+    }
+    uint64_t *under = scratch.under.data();
+
+    for (int j = int(box.p0.y); j <= int(box.p1.y); j++) {
+        glm::ivec2 span = spans[j - int(box.p0.y)];
+        if (span.x >= span.y) continue;
+        __Under__(map, footprint, origin, j, span, under);
+        const uint64_t *cloud_free = bitmaps.cloudFree.row(j);
+        const uint64_t *candidates = bitmaps.candidates.row(j);
+        for (int w = span.x >> 6; w <= (span.y - 1) >> 6; w++) {
+            // If the pixel in shadow space isnt a cloud and is under the desired cloud
+            T += std::popcount(under[w] & cloud_free[w]);
+            // If the pixel is indeed a shadow
+            C += std::popcount(under[w] & candidates[w]);
+        }
+        R -= __Candidates__(bitmaps.candidates, j, span);
+        if (hopeless()) {
+            ret.pruned = true;
+            return ret;
+        }
+    }
+    if (T >= 5) ret.similarity = float(C) / float(T);
+    return ret;
+}
+struct __MatchCloudShadow__Ret {
+    OptimalSolution solution;
+    unsigned int evaluatedHeights;
+    unsigned int prunedHeights;
+};
+// A cloud without a shadow similar enough to count
+__MatchCloudShadow__Ret __Unmatched__(int id) {
+    __MatchCloudShadow__Ret ret;
+    ret.solution.similarity = -1.f;
+    ret.solution.height     = 0.f;  // Not actually 0 but at this height, it is treated as NULL
+    ret.solution.M          = glm::mat4(1.f);
+    ret.solution.id         = id;
+    ret.evaluatedHeights    = 0u;
+    ret.prunedHeights       = 0u;
+    return ret;
+}
+// Appends the shadow of cloud k cast by the solution, its runs and their bounds as its quad.
+// Unmatched clouds get an empty shadow in place
+void __CastShadow__(
+    const CloudQuads &clouds,
+    size_t k,
+    const BitImage &footprint,
+    const __Bitmaps__ &bitmaps,
+    const OptimalSolution &solution,
+    std::shared_ptr<ImageBool> cloudMask,
+    std::shared_ptr<ImageBool> potentialShadow,
+    float DiagonalLength,
+    ShadowQuads &shadows
+) {
+    if (solution.similarity < MinimumSimilarity) {
+        unsigned int nan = Functions::nan<unsigned int>();
+        shadows.push_back(clouds.ids[k], {{nan, nan}, {nan, nan}}, clouds.quads[k]);
+        return;
+    }
+    ImageBounds box = __ShadowBox__(solution.M * clouds.quads[k], potentialShadow, DiagonalLength);
+    glm::mat4 M_inverse = glm::inverse(solution.M);
+    AffinePixelMap map  = affinePixelMap(potentialShadow, cloudMask, DiagonalLength, M_inverse);
+    glm::ivec2 origin   = glm::ivec2(clouds.bounds[k].p0);
 
     unsigned int min_x_out = std::numeric_limits<unsigned int>::max();
     unsigned int min_y_out = std::numeric_limits<unsigned int>::max();
     unsigned int max_x_out = 0u;
     unsigned int max_y_out = 0u;
 
-    float W = cloudMap->cols();
-    float H = cloudMap->rows();
-
-    float ratio   = DiagonalLength / sqrtf(W * W + H * H);
-    float ratio_r = 1.f / ratio;
-
-    glm::ivec2 shadow_pixel;
-    glm::vec2 delta = M_inverse * glm::vec4(.5f, .5f, 0.f, ratio_r);
-    glm::mat2 M2    = glm::mat2(M_inverse);
-
-    glm::uvec2 pixel;
-    for (pixel.x = min_x_in; pixel.x <= max_x_in; pixel.x++) {
-        for (pixel.y = min_y_in; pixel.y <= max_y_in; pixel.y++) {
-            if (!at(cloudMask, pixel.x, pixel.y)) {
-                // If the pixel in shadow space isnt a cloud
-                shadow_pixel = M2 * pixel + delta;
-                if (valid(cloudMap, shadow_pixel.x, shadow_pixel.y)) {
-                    // If the pixel is under the desired cloud
-                    if (at(cloudMap, shadow_pixel.x, shadow_pixel.y) == cloud.pixels.id) {
-                        // If the pixel is indeed a shadow
-                        T++;
-                        if (at(potentialShadow, pixel.x, pixel.y)) {
-                            C++;
-                            ret.shadow.pixels.list.push_back(pixel);
-                            min_x_out = std::min(min_x_out, pixel.x);
-                            min_y_out = std::min(min_y_out, pixel.y);
-                            max_x_out = std::max(max_x_out, pixel.x);
-                            max_y_out = std::max(max_y_out, pixel.y);
-                        }
-                    }
-                }
+    std::vector<uint64_t> under(bitmaps.candidates.stride);
+    for (int j = int(box.p0.y); j <= int(box.p1.y); j++) {
+        glm::ivec2 span = mappedSpan(map, j, clouds.bounds[k], int(box.p0.x), int(box.p1.x) + 1);
+        if (span.x >= span.y) continue;
+        __Under__(map, footprint, origin, j, span, under.data());
+        const uint64_t *candidates = bitmaps.candidates.row(j);
+        for (int w = span.x >> 6; w <= (span.y - 1) >> 6; w++) {
+            for (uint64_t hits = under[w] & candidates[w]; hits; hits &= hits - 1) {
+                unsigned int i = unsigned(w) * 64u + unsigned(std::countr_zero(hits));
+                shadows.append(i, unsigned(j));
+                min_x_out = std::min(min_x_out, i);
+                min_y_out = std::min(min_y_out, unsigned(j));
+                max_x_out = std::max(max_x_out, i);
+                max_y_out = std::max(max_y_out, unsigned(j));
             }
         }
     }
-    if (T < 5) {
-        ret.similarity = -1.1f;
-        ret.shadow.pixels.list.clear();
-    } else {
-        ret.similarity = float(C) / float(T);
-        ret.shadow.quad.p00
-            = pos(cloudMask, DiagonalLength, min_x_out, min_y_out, .1f, .1f);  // p11---p10
-        ret.shadow.quad.p01
-            = pos(cloudMask, DiagonalLength, max_x_out, min_y_out, .9f, .1f);  //  |<<<<<|
-        ret.shadow.quad.p10
-            = pos(cloudMask, DiagonalLength, max_x_out, max_y_out, .9f, .9f);  //  |>>>>>|
-        ret.shadow.quad.p11
-            = pos(cloudMask, DiagonalLength, min_x_out, max_y_out, .1f, .9f);  // p00---p01
-        ret.shadow.pixels.bounds.p0 = glm::uvec2(min_x_out, min_y_out);
-        ret.shadow.pixels.bounds.p1 = glm::uvec2(max_x_out, max_y_out);
-    }
-    return ret;
+    Quad quad;
+    quad.p00 = pos(*cloudMask, DiagonalLength, min_x_out, min_y_out, .1f, .1f);  // p11---p10
+    quad.p01 = pos(*cloudMask, DiagonalLength, max_x_out, min_y_out, .9f, .1f);  //  |<<<<<|
+    quad.p10 = pos(*cloudMask, DiagonalLength, max_x_out, max_y_out, .9f, .9f);  //  |>>>>>|
+    quad.p11 = pos(*cloudMask, DiagonalLength, min_x_out, max_y_out, .1f, .9f);  // p00---p01
+    shadows.push_back(clouds.ids[k], {{min_x_out, min_y_out}, {max_x_out, max_y_out}}, quad);
 }
-struct __MatchCloudShadow__Ret {
-    OptimalSolution solution;
-    ShadowQuad shadow;
-};
 __MatchCloudShadow__Ret __MatchCloudShadow__(
-    CloudQuad cloud,
-    std::shared_ptr<ImageInt> cloudMap,
+    const CloudQuads &clouds,
+    size_t k,
+    const BitImage &footprint,
+    const __Bitmaps__ &bitmaps,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> potentialShadow,
     float DiagonalLength,
     glm::vec3 sunPos,
     glm::vec3 viewPos
 ) {
-    __MatchCloudShadow__Ret ret;
-    ret.solution.similarity     = -1.f;
-    ret.solution.height         = 0.f;
-    ret.solution.M              = glm::mat4(1.f);
-    ret.solution.id             = cloud.pixels.id;
-    ret.shadow.quad             = cloud.quad;
-    ret.shadow.pixels.bounds.p0 = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-    ret.shadow.pixels.bounds.p1 = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-    ret.shadow.pixels.id        = cloud.pixels.id;
-    // Rest have default constructors
-    Quad casted;
-    glm::mat4 M;
-    Plane height_plane({0.f, 0.f, 0.f}, {0.f, 0.f, 1.f});
-    Plane ground_plane({0.f, 0.f, 0.f}, {0.f, 0.f, 1.f});
+    __MatchCloudShadow__Ret ret = __Unmatched__(clouds.ids[k]);
     __SimilarityComparision__Return sim_ret;
-    for (height_plane.p0.z = .2f; height_plane.p0.z <= 12.f; height_plane.p0.z += .025f) {
-        casted  = Functions::perspective(cloud.quad, viewPos, height_plane);
-        casted  = Functions::perspective(casted, sunPos, ground_plane);
-        M       = Functions::affineTransform(cloud.quad, casted);
-        M[2][2] = 1.f;  // Make matrix invertable by leaving z direction identity
-        sim_ret = __SimilarityComparision__(
-            cloud, M, cloudMap, cloudMask, potentialShadow, DiagonalLength
+    __Scratch__ scratch = {
+        std::vector<glm::ivec2>(potentialShadow->rows()),
+        std::vector<uint64_t>(bitmaps.candidates.stride)};
+    for (float height : __Heights__()) {
+        glm::mat4 M = __Transform__(clouds.quads[k], height, sunPos, viewPos);
+        sim_ret     = __SimilarityComparision__(
+            clouds,
+            k,
+            footprint,
+            bitmaps,
+            scratch,
+            M,
+            ret.solution.similarity,
+            cloudMask,
+            potentialShadow,
+            DiagonalLength
         );
+        if (sim_ret.pruned) {
+            ret.prunedHeights++;
+            continue;
+        }
+        ret.evaluatedHeights++;
         if (sim_ret.similarity > ret.solution.similarity) {
             ret.solution.similarity = sim_ret.similarity;
-            ret.solution.height     = height_plane.p0.z;
+            ret.solution.height     = height;
             ret.solution.M          = M;
-            ret.shadow              = sim_ret.shadow;
         }
     }
     // Must be at least this similar to count
-    if (ret.solution.similarity < .3f) {
-        ret.solution.similarity = -1.f;
-        ret.solution.height = 0.f;  // Not actually 0 but at this height, it will be treated as NULL
-        ret.solution.M      = glm::mat4(1.f);
-        ret.shadow.quad     = cloud.quad;
-        ret.shadow.pixels.bounds.p0
-            = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-        ret.shadow.pixels.bounds.p1
-            = {Functions::nan<unsigned int>(), Functions::nan<unsigned int>()};
-        ret.shadow.pixels.list.clear();
+    if (ret.solution.similarity < MinimumSimilarity) {
+        __MatchCloudShadow__Ret unmatched = __Unmatched__(clouds.ids[k]);
+        unmatched.evaluatedHeights        = ret.evaluatedHeights;
+        unmatched.prunedHeights           = ret.prunedHeights;
+        return unmatched;
     }
     return ret;
 }
+// Adds the solution of the shadow last cast
+void __Insert__(
+    MatchCloudsShadowsResults &ret, std::vector<float> &heights, const __MatchCloudShadow__Ret &sol
+) {
+    ret.solutions.push_back(sol.solution);
+    ret.evaluatedHeights += sol.evaluatedHeights;
+    ret.prunedHeights    += sol.prunedHeights;
+    rasterize(ret.shadowMask, ret.shadows.list(ret.shadows.size() - 1), true);
+    // Only Valid Heights
+    if (sol.solution.height >= .2f) heights.push_back(sol.solution.height);
+}
+MatchCloudsShadowsResults __Results__(std::shared_ptr<ImageBool> cloudMask) {
+    MatchCloudsShadowsResults ret;
+    ret.trimmedMeanHeight = 0.f;
+    ret.shadowMask        = ImagePool::Make<bool>(cloudMask->rows(), cloudMask->cols());
+    ret.shadowMask->fill(false);
+    ret.evaluatedHeights = 0u;
+    ret.prunedHeights    = 0u;
+    ret.onDevice         = false;
+    return ret;
+}
 
 MatchCloudsShadowsResults MatchCloudsShadows(
-    CloudQuads clouds,
+    const CloudQuads &clouds,
     std::shared_ptr<ImageInt> cloudMap,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> potentialShadow,
@@ -179,25 +342,308 @@ MatchCloudsShadowsResults MatchCloudsShadows(
     glm::vec3 sunPos,
     glm::vec3 viewPos
 ) {
-    MatchCloudsShadowsResults ret;
-    ret.trimmedMeanHeight = 0.f;
-    ret.shadowMask        = std::make_shared<ImageBool>(cloudMask->rows(), cloudMask->cols());
-    ret.shadowMask->fill(false);
+    MatchCloudsShadowsResults ret = __Results__(cloudMask);
+    __Bitmaps__ bitmaps = {
+        pack(evaluate(NOT(lazy(cloudMask)))),
+        pack(evaluate(AND(lazy(potentialShadow), NOT(lazy(cloudMask)))))};
     std::vector<float> heights;
     heights.reserve(clouds.size());
-    for (auto &c : clouds) {
+    ret.solutions.reserve(clouds.size());
+    for (size_t k = 0; k < clouds.size(); k++) {
+        BitImage footprint          = __Footprint__(clouds, k);
         __MatchCloudShadow__Ret sol = __MatchCloudShadow__(
-            c.second, cloudMap, cloudMask, potentialShadow, DiagonalLength, sunPos, viewPos
+            clouds,
+            k,
+            footprint,
+            bitmaps,
+            cloudMask,
+            potentialShadow,
+            DiagonalLength,
+            sunPos,
+            viewPos
+        );
+        __CastShadow__(
+            clouds,
+            k,
+            footprint,
+            bitmaps,
+            sol.solution,
+            cloudMask,
+            potentialShadow,
+            DiagonalLength,
+            ret.shadows
+        );
+        __Insert__(ret, heights, sol);
+    }
+    // Only use the Middle 80%
+    ret.trimmedMeanHeight = Functions::trimmedAverage(heights, 0.1f, 0.9f);
+    return ret;
+}
+
+// Work items sharing one (cloud, height) pair, and pairs scored per launch
+static const size_t WorkGroupSize  = 64u;
+static const size_t PairsPerLaunch = 1u << 14;
+
+// Must not contract the pixel map arithmetic, the pixels sampled have to be the host's
+const char cl_kernel_code[] = "#pragma OPENCL FP_CONTRACT OFF\n" BOOST_COMPUTE_STRINGIZE_SOURCE(
+    __kernel void SimilarityCounts(
+        __global const int *cloudMap,
+        __global const ulong *cloudFree,
+        __global const ulong *candidates,
+        const int stride,
+        const int width,
+        const int height,
+        __global const float *maps,
+        __global const int *boxes,
+        __global const int *ids,
+        __global uint *counts
+    ) {
+        __local uint T_local[WORK_GROUP_SIZE];
+        __local uint C_local[WORK_GROUP_SIZE];
+        int pair = get_group_id(0);
+        int lid  = get_local_id(0);
+
+        float origin_x             = maps[6 * pair + 0];
+        float origin_y             = maps[6 * pair + 1];
+        float di_x                 = maps[6 * pair + 2];
+        float di_y                 = maps[6 * pair + 3];
+        float dj_x                 = maps[6 * pair + 4];
+        float dj_y                 = maps[6 * pair + 5];
+        __global const int *box    = boxes + 8 * pair;      // Shadow box
+        __global const int *bounds = boxes + 8 * pair + 4;  // Cloud bounds
+        int id                     = ids[pair];
+
+        uint T = 0;
+        uint C = 0;
+        for (int j = box[1]; j <= box[3]; j++) {
+            float base_x = origin_x + (float)j * dj_x;
+            float base_y = origin_y + (float)j * dj_y;
+            // The columns that can map into the cloud's bounds as mappedSpan finds them, a pixel
+            // wider each side than exact so division rounding cannot drop one the host counts
+            float first = (float)box[0];
+            float last  = (float)(box[2] + 1);
+            for (int a = 0; a < 2; a++) {
+                float base = a == 0 ? base_x : base_y;
+                float d    = a == 0 ? di_x : di_y;
+                float lo   = (float)bounds[a] - base;
+                float hi   = (float)bounds[2 + a] + 1.f - base;
+                if (d == 0.f) {
+                    if (lo > 0.f || hi <= 0.f) last = first;
+                    continue;
+                }
+                first = max(first, min(lo / d, hi / d) - 1.f);
+                last  = min(last, max(lo / d, hi / d) + 2.f);
+            }
+            // Empty before either end is cast, far off the image they need not fit an int
+            if (!(first < last)) continue;
+            int end = (int)ceil(last);
+            for (int i = (int)floor(first) + lid; i < end; i += WORK_GROUP_SIZE) {
+                int x = (int)floor(base_x + (float)i * di_x);
+                int y = (int)floor(base_y + (float)i * di_y);
+                // The cloud map is stored top row first, the bitmaps bottom row first
+                bool under = x >= 0 && x < width && y >= 0 && y < height
+                          && cloudMap[(height - 1 - y) * width + x] == id;
+                int word  = j * stride + (i >> 6);
+                ulong bit = (ulong)1 << (i & 63);
+                T += under && (cloudFree[word] & bit) ? 1 : 0;
+                C += under && (candidates[word] & bit) ? 1 : 0;
+            }
+        }
+
+        T_local[lid] = T;
+        C_local[lid] = C;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for (int s = WORK_GROUP_SIZE / 2; s > 0; s /= 2) {
+            if (lid < s) {
+                T_local[lid] += T_local[lid + s];
+                C_local[lid] += C_local[lid + s];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        if (lid == 0) {
+            counts[2 * pair + 0] = T_local[0];
+            counts[2 * pair + 1] = C_local[0];
+        }
+    }
+);
+
+MatchingContext::MatchingContext(command_queue queue)
+    : queue(queue) {
+    try {
+        Kernel = kernel(
+            SharedProgram(cl_kernel_code, "-DWORK_GROUP_SIZE=" + std::to_string(WorkGroupSize)),
+            "SimilarityCounts"
+        );
+        cloudMap   = vector<int>(1, queue.get_context());
+        cloudFree  = vector<uint64_t>(1, queue.get_context());
+        candidates = vector<uint64_t>(1, queue.get_context());
+        maps       = vector<float>(6 * PairsPerLaunch, queue.get_context());
+        boxes      = vector<int>(8 * PairsPerLaunch, queue.get_context());
+        ids        = vector<int>(PairsPerLaunch, queue.get_context());
+        counts     = vector<unsigned int>(2 * PairsPerLaunch, queue.get_context());
+        // The reduction needs every work item of a group resident at once
+        size_t group_size = Kernel.get_work_group_info<size_t>(
+            queue.get_device(), CL_KERNEL_WORK_GROUP_SIZE
+        );
+        usable = group_size >= WorkGroupSize;
+        if (!usable)
+            Log::warning(
+                "Shadow matching needs work groups of {}, the device runs {}, matching on the host",
+                WorkGroupSize,
+                group_size
+            );
+    } catch (opencl_error error) {
+        Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
+    }
+}
+
+MatchCloudsShadowsResults MatchCloudsShadows(
+    MatchingContext &context,
+    const CloudQuads &clouds,
+    std::shared_ptr<ImageInt> cloudMap,
+    std::shared_ptr<ImageBool> cloudMask,
+    std::shared_ptr<ImageBool> potentialShadow,
+    float DiagonalLength,
+    glm::vec3 sunPos,
+    glm::vec3 viewPos
+) {
+    if (!context.usable)
+        return MatchCloudsShadows(
+            clouds, cloudMap, cloudMask, potentialShadow, DiagonalLength, sunPos, viewPos
+        );
+    MatchCloudsShadowsResults ret = __Results__(cloudMask);
+    __Bitmaps__ bitmaps = {
+        pack(evaluate(NOT(lazy(cloudMask)))),
+        pack(evaluate(AND(lazy(potentialShadow), NOT(lazy(cloudMask)))))};
+
+    // The pixel map, shadow box and cloud bounds of every pair, clouds in order with their
+    // heights swept
+    std::vector<float> sweep = __Heights__();
+    size_t pairs             = clouds.size() * sweep.size();
+    std::vector<float> maps(6 * pairs);
+    std::vector<int> boxes(8 * pairs);
+    std::vector<int> ids(pairs);
+    std::vector<unsigned int> counts(2 * pairs);
+    size_t pixels = 0u;
+    size_t pair   = 0u;
+    for (size_t k = 0; k < clouds.size(); k++) {
+        for (float height : sweep) {
+            glm::mat4 M        = __Transform__(clouds.quads[k], height, sunPos, viewPos);
+            AffinePixelMap map = affinePixelMap(
+                potentialShadow, cloudMask, DiagonalLength, glm::inverse(M)
+            );
+            ImageBounds box = __ShadowBox__(M * clouds.quads[k], potentialShadow, DiagonalLength);
+            const ImageBounds &bounds = clouds.bounds[k];
+            std::copy_n(&map.origin.x, 2, &maps[6 * pair + 0]);
+            std::copy_n(&map.di.x, 2, &maps[6 * pair + 2]);
+            std::copy_n(&map.dj.x, 2, &maps[6 * pair + 4]);
+            boxes[8 * pair + 0] = int(box.p0.x);
+            boxes[8 * pair + 1] = int(box.p0.y);
+            boxes[8 * pair + 2] = int(box.p1.x);
+            boxes[8 * pair + 3] = int(box.p1.y);
+            boxes[8 * pair + 4] = int(bounds.p0.x);
+            boxes[8 * pair + 5] = int(bounds.p0.y);
+            boxes[8 * pair + 6] = int(bounds.p1.x);
+            boxes[8 * pair + 7] = int(bounds.p1.y);
+            ids[pair]           = clouds.ids[k];
+            pixels += size_t(box.p1.x - box.p0.x + 1) * size_t(box.p1.y - box.p0.y + 1);
+            pair++;
+        }
+    }
+
+    // Only the transfers and launches are timed, the host's setup and shadows are not device work
+    auto start    = std::chrono::steady_clock::now();
+    bool launched = false;
+    try {
+        const std::vector<uint64_t> &cloud_free = bitmaps.cloudFree.words;
+        const std::vector<uint64_t> &candidates = bitmaps.candidates.words;
+        if (context.cloudMap.size() != size_t(cloudMap->size()))
+            context.cloudMap = vector<int>(cloudMap->size(), context.queue.get_context());
+        if (context.cloudFree.size() != cloud_free.size()) {
+            context.cloudFree  = vector<uint64_t>(cloud_free.size(), context.queue.get_context());
+            context.candidates = vector<uint64_t>(candidates.size(), context.queue.get_context());
+        }
+        copy_n(cloudMap->data(), cloudMap->size(), context.cloudMap.begin(), context.queue);
+        copy_n(cloud_free.data(), cloud_free.size(), context.cloudFree.begin(), context.queue);
+        copy_n(candidates.data(), candidates.size(), context.candidates.begin(), context.queue);
+        for (size_t first = 0u; first < pairs; first += PairsPerLaunch) {
+            size_t n = std::min(PairsPerLaunch, pairs - first);
+            copy_n(maps.data() + 6 * first, 6 * n, context.maps.begin(), context.queue);
+            copy_n(boxes.data() + 8 * first, 8 * n, context.boxes.begin(), context.queue);
+            copy_n(ids.data() + first, n, context.ids.begin(), context.queue);
+            context.Kernel.set_arg(0, context.cloudMap.get_buffer());
+            context.Kernel.set_arg(1, context.cloudFree.get_buffer());
+            context.Kernel.set_arg(2, context.candidates.get_buffer());
+            context.Kernel.set_arg(3, int(bitmaps.candidates.stride));
+            context.Kernel.set_arg(4, int(cloudMask->cols()));
+            context.Kernel.set_arg(5, int(cloudMask->rows()));
+            context.Kernel.set_arg(6, context.maps.get_buffer());
+            context.Kernel.set_arg(7, context.boxes.get_buffer());
+            context.Kernel.set_arg(8, context.ids.get_buffer());
+            context.Kernel.set_arg(9, context.counts.get_buffer());
+            context.queue.enqueue_1d_range_kernel(
+                context.Kernel, 0, n * WorkGroupSize, WorkGroupSize
+            );
+            copy_n(context.counts.begin(), 2 * n, counts.data() + 2 * first, context.queue);
+        }
+        launched = true;
+    } catch (opencl_error error) {
+        Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
+    }
+    double seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    // Counts left unwritten would report every cloud unmatched, the host sweep is exact instead
+    if (!launched) {
+        Log::warning("Shadow matching on the device failed, matching on the host");
+        return MatchCloudsShadows(
+            clouds, cloudMap, cloudMask, potentialShadow, DiagonalLength, sunPos, viewPos
+        );
+    }
+    ret.onDevice = true;
+
+    // The best height of each cloud as the host sweep would pick it, then its shadow built once
+    std::vector<float> heights;
+    heights.reserve(clouds.size());
+    ret.solutions.reserve(clouds.size());
+    pair = 0u;
+    for (size_t k = 0; k < clouds.size(); k++) {
+        __MatchCloudShadow__Ret sol = __Unmatched__(clouds.ids[k]);
+        for (float height : sweep) {
+            unsigned int T   = counts[2 * pair + 0];
+            unsigned int C   = counts[2 * pair + 1];
+            float similarity = T < 5 ? -1.1f : float(C) / float(T);
+            if (similarity > sol.solution.similarity) {
+                sol.solution.similarity = similarity;
+                sol.solution.height     = height;
+            }
+            pair++;
+        }
+        sol.evaluatedHeights = unsigned(sweep.size());
+        BitImage footprint;
+        if (sol.solution.similarity >= MinimumSimilarity) {
+            sol.solution.M = __Transform__(clouds.quads[k], sol.solution.height, sunPos, viewPos);
+            footprint      = __Footprint__(clouds, k);
+        } else {
+            __MatchCloudShadow__Ret unmatched = __Unmatched__(clouds.ids[k]);
+            unmatched.evaluatedHeights        = sol.evaluatedHeights;
+            sol                               = unmatched;
+        }
+        __CastShadow__(
+            clouds,
+            k,
+            footprint,
+            bitmaps,
+            sol.solution,
+            cloudMask,
+            potentialShadow,
+            DiagonalLength,
+            ret.shadows
         );
-        ret.solutions.insert({c.first, sol.solution});
-        ret.shadows.insert({c.first, sol.shadow});
-        for (auto &p : sol.shadow.pixels.list)
-            set(ret.shadowMask, p.x, p.y, true);
-        // Only Valid Heights
-        if (sol.solution.height >= .2f) heights.push_back(sol.solution.height);
+        __Insert__(ret, heights, sol);
     }
     // Only use the Middle 80%
     ret.trimmedMeanHeight = Functions::trimmedAverage(heights, 0.1f, 0.9f);
+    RecordWork(context.queue, pixels, seconds);
     return ret;
 }
-}  // namespace CloudShadowMatching
\ No newline at end of file
+}  // namespace CloudShadowMatching
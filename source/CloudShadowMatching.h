@@ -1,4 +1,7 @@
 #pragma once
+#include <boost/compute/container/vector.hpp>
+#include <boost/compute/core.hpp>
+
 #include "types.h"
 
 namespace CloudShadowMatching {
@@ -9,13 +12,42 @@ struct OptimalSolution {
     int id;
 };
 struct MatchCloudsShadowsResults {
-    std::map<int, OptimalSolution> solutions;
+    std::vector<OptimalSolution> solutions;  // One per cloud, in the order of the cloud table
     float trimmedMeanHeight;
-    ShadowQuads shadows;
+    ShadowQuads shadows;  // One per cloud as well, empty for clouds without a solution
     std::shared_ptr<ImageBool> shadowMask;
+    unsigned int evaluatedHeights;  // Heights whose similarity was scored in full
+    unsigned int prunedHeights;     // Heights dropped early as unable to change the optimum
+    bool onDevice;  // Scored on the device, which sweeps every height and prunes none
+};
+// Kernel and buffers bound to one queue, only one thread may use a context at a time
+struct MatchingContext {
+    explicit MatchingContext(boost::compute::command_queue queue);
+    boost::compute::command_queue queue;
+    boost::compute::kernel Kernel;
+    bool usable = false;  // Kernel built and able to run a full work group on the device
+    boost::compute::vector<int> cloudMap;
+    boost::compute::vector<uint64_t> cloudFree;   // Bit packed as __Bitmaps__ holds them
+    boost::compute::vector<uint64_t> candidates;
+    boost::compute::vector<float> maps;
+    boost::compute::vector<int> boxes;
+    boost::compute::vector<int> ids;
+    boost::compute::vector<unsigned int> counts;
 };
 MatchCloudsShadowsResults MatchCloudsShadows(
-    CloudQuads clouds,
+    const CloudQuads &clouds,
+    std::shared_ptr<ImageInt> cloudMap,
+    std::shared_ptr<ImageBool> cloudMask,
+    std::shared_ptr<ImageBool> potentialShadow,
+    float DiagonalLength,
+    glm::vec3 sunPos,
+    glm::vec3 viewPos
+);
+// Scores every (cloud, height) pair on the device, only the winning shadows are built on the host.
+// Falls back to the host overload when the context is unusable or a launch fails
+MatchCloudsShadowsResults MatchCloudsShadows(
+    MatchingContext &context,
+    const CloudQuads &clouds,
     std::shared_ptr<ImageInt> cloudMap,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> potentialShadow,
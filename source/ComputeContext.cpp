@@ -0,0 +1,13 @@
+#include "ComputeContext.h"
+
+#include "ComputeEnvironment.h"
+
+namespace ComputeEnvironment {
+SceneContext::SceneContext()
+    : queueIndex(AcquireQueue())
+    , gaussianBlur(CommandQueues[queueIndex])
+    , pitFill(CommandQueues[queueIndex])
+    , matching(CommandQueues[queueIndex]) {}
+
+SceneContext::~SceneContext() { ReleaseQueue(queueIndex); }
+}  // namespace ComputeEnvironment
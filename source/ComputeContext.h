@@ -0,0 +1,21 @@
+#pragma once
+
+#include "CloudShadowMatching.h"
+#include "GaussianBlur.h"
+#include "ImagePool.h"
+#include "PitFillAlgorithm.h"
+
+namespace ComputeEnvironment {
+// Per-scene OpenCL state, holds one queue for its lifetime so scenes can run concurrently
+struct SceneContext {
+    SceneContext();
+    ~SceneContext();
+    SceneContext(const SceneContext &)            = delete;
+    SceneContext &operator=(const SceneContext &) = delete;
+    ImagePool::Scene images;  // Opened first so it closes after the rest of the scene
+    size_t queueIndex;
+    GaussianBlur::GaussianBlurContext gaussianBlur;
+    PitFillAlgorithm::PitFillContext pitFill;
+    CloudShadowMatching::MatchingContext matching;
+};
+}  // namespace ComputeEnvironment
@@ -1,15 +1,356 @@
 #include "ComputeEnvironment.h"
 
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/compute/detail/sha1.hpp>
+
+#include "boilerplate/Log.h"
+
 using namespace boost::compute;
 
 namespace ComputeEnvironment {
 context Context;
 command_queue CommandQueue;
+std::vector<command_queue> CommandQueues;
+std::optional<Path> CacheDirectory;
+std::mutex ProgramMutex;
+std::map<std::string, program> Programs;
+
+struct QueueState {
+    unsigned int active = 0u;
+    DeviceThroughput throughput;
+};
+std::mutex QueueMutex;
+std::vector<QueueState> QueueStates;
+
+bool IsIndex(const std::string &s) {
+    return !s.empty()
+        && std::all_of(s.begin(), s.end(), [](unsigned char c) { return std::isdigit(c); });
+}
+
+bool ContainsIgnoreCase(std::string haystack, std::string needle) {
+    auto lower = [](unsigned char c) { return char(std::tolower(c)); };
+    std::transform(haystack.begin(), haystack.end(), haystack.begin(), lower);
+    std::transform(needle.begin(), needle.end(), needle.begin(), lower);
+    return haystack.find(needle) != std::string::npos;
+}
+
+cl_device_type DeviceType(std::string type) {
+    std::transform(type.begin(), type.end(), type.begin(), [](unsigned char c) {
+        return char(std::tolower(c));
+    });
+    if (type.empty() || type == "all") return CL_DEVICE_TYPE_ALL;
+    if (type == "gpu") return device::gpu;
+    if (type == "cpu") return device::cpu;
+    if (type == "accelerator") return device::accelerator;
+    throw std::runtime_error("Unknown OpenCL device type: " + type);
+}
+
+void InitMainContext() { InitMainContext(DeviceSelection()); }
+
+void InitMainContext(const DeviceSelection &selection) {
+    // Platform by index or name
+    std::vector<platform> platforms = system::platforms();
+    if (platforms.empty()) throw std::runtime_error("No OpenCL platforms available");
+    platform chosen_platform = platforms[0];
+    if (IsIndex(selection.platform)) {
+        size_t index = std::stoul(selection.platform);
+        if (index >= platforms.size())
+            throw std::runtime_error("OpenCL platform index out of range: " + selection.platform);
+        chosen_platform = platforms[index];
+    } else if (!selection.platform.empty()) {
+        auto it = std::find_if(platforms.begin(), platforms.end(), [&](const platform &p) {
+            return ContainsIgnoreCase(p.name(), selection.platform);
+        });
+        if (it == platforms.end())
+            throw std::runtime_error("No OpenCL platform named: " + selection.platform);
+        chosen_platform = *it;
+    }
+
+    // Devices by type, then index or name
+    std::vector<device> devices = chosen_platform.devices(DeviceType(selection.type));
+    if (IsIndex(selection.device)) {
+        size_t index = std::stoul(selection.device);
+        if (index >= devices.size())
+            throw std::runtime_error("OpenCL device index out of range: " + selection.device);
+        devices = {devices[index]};
+    } else if (!selection.device.empty()) {
+        std::erase_if(devices, [&](const device &d) {
+            return !ContainsIgnoreCase(d.name(), selection.device);
+        });
+    }
+    if (devices.empty()) throw std::runtime_error("No OpenCL device matches the selection");
+
+    // Device fission of CPUs, so a host can be scheduled as several independent queues
+    if (selection.subDevices > 1u) {
+        std::vector<device> split;
+        for (auto &dev : devices) {
+            if (dev.type() & device::cpu) {
+                try {
+                    size_t units = std::max<size_t>(1u, dev.compute_units() / selection.subDevices);
+                    std::vector<device> parts = dev.partition_equally(units);
+                    split.insert(split.end(), parts.begin(), parts.end());
+                    continue;
+                } catch (opencl_error &error) {
+                    Log::warning(
+                        "Device {} could not be partitioned: {}", dev.name(), error.error_string()
+                    );
+                }
+            }
+            split.push_back(dev);
+        }
+        devices = split;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ProgramMutex);
+        Programs.clear();
+    }
+    Context = context(devices);
+    CommandQueues.clear();
+    for (auto &dev : Context.get_devices())
+        CommandQueues.push_back(command_queue(Context, dev));
+    CommandQueue = CommandQueues[0];
+
+    std::lock_guard<std::mutex> lock(QueueMutex);
+    QueueStates = std::vector<QueueState>(CommandQueues.size());
+    for (size_t i = 0; i < QueueStates.size(); i++)
+        QueueStates[i].throughput.name
+            = fmt::format("{} ({})", CommandQueues[i].get_device().name(), i);
+}
+
+size_t AcquireQueue() {
+    std::lock_guard<std::mutex> lock(QueueMutex);
+    if (QueueStates.empty()) throw std::runtime_error("The compute context is not initialized");
+    auto least
+        = std::min_element(QueueStates.begin(), QueueStates.end(), [](auto &a, auto &b) {
+              if (a.active != b.active) return a.active < b.active;
+              return a.throughput.seconds < b.throughput.seconds;
+          });
+    least->active++;
+    return size_t(std::distance(QueueStates.begin(), least));
+}
+
+void ReleaseQueue(size_t index) {
+    std::lock_guard<std::mutex> lock(QueueMutex);
+    if (index < QueueStates.size() && QueueStates[index].active > 0u)
+        QueueStates[index].active--;
+}
+
+void RecordWork(const command_queue &queue, size_t pixels, double seconds) {
+    std::lock_guard<std::mutex> lock(QueueMutex);
+    for (size_t i = 0; i < QueueStates.size(); i++) {
+        if (CommandQueues[i].get() != queue.get()) continue;
+        QueueStates[i].throughput.jobs++;
+        QueueStates[i].throughput.pixels += pixels;
+        QueueStates[i].throughput.seconds += seconds;
+        return;
+    }
+}
+
+double DeviceThroughput::megaPixelsPerSecond() const {
+    return (seconds > 0.) ? double(pixels) / (1.e6 * seconds) : 0.;
+}
+
+std::vector<DeviceThroughput> Throughput() {
+    std::lock_guard<std::mutex> lock(QueueMutex);
+    std::vector<DeviceThroughput> ret;
+    for (auto &state : QueueStates)
+        ret.push_back(state.throughput);
+    return ret;
+}
+
+std::string ThroughputReport() {
+    std::stringstream buffer;
+    for (auto &t : Throughput())
+        buffer << "\n\t" << t.name << ": " << t.jobs << " jobs, " << t.pixels << " pixels in "
+               << t.seconds << " s (" << t.megaPixelsPerSecond() << " MPixel/s)";
+    return buffer.str();
+}
+
+void SetProgramCacheDirectory(Path directory) { CacheDirectory = directory; }
+
+// Per user, the shared temporary directory would let anyone plant binaries for others to load
+Path ProgramCacheDirectory() {
+    if (!CacheDirectory.has_value()) {
+        const char *xdg  = std::getenv("XDG_CACHE_HOME");
+        const char *home = std::getenv("HOME");
+        if (xdg && *xdg) CacheDirectory = Path(xdg) / "Cloud-Shadow-Detection" / "kernels";
+        else if (home && *home)
+            CacheDirectory = Path(home) / ".cache" / "Cloud-Shadow-Detection" / "kernels";
+        else CacheDirectory = Path();
+    }
+    return CacheDirectory.value();
+}
+
+// Creates the directory private to the user, and refuses one owned by someone else or writable by
+// anyone but its owner
+bool PrivateDirectory(const Path &directory) {
+    if (std::filesystem::create_directories(directory))
+        std::filesystem::permissions(
+            directory, std::filesystem::perms::owner_all, std::filesystem::perm_options::replace
+        );
+    struct stat info;
+    if (stat(directory.c_str(), &info) != 0 || !S_ISDIR(info.st_mode)) return false;
+    return info.st_uid == geteuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+std::string ProgramCacheKey(const std::string &source, const std::string &options) {
+    detail::sha1 hash;
+    for (auto &dev : Context.get_devices()) {
+        platform plat = dev.platform();
+        hash.process(plat.name())
+            .process(plat.version())
+            .process(dev.name())
+            .process(dev.version())
+            .process(dev.driver_version());
+    }
+    hash.process(options).process(source);
+    return hash;
+}
+
+// File layout: device count, then the size and bytes of each device binary in context order
+std::optional<program> LoadProgramBinary(const Path &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return std::nullopt;
+
+    std::vector<cl_device_id> device_ids;
+    for (auto &dev : Context.get_devices())
+        device_ids.push_back(dev.id());
+
+    uint64_t count = 0;
+    file.read(reinterpret_cast<char *>(&count), sizeof(count));
+    if (!file || count != device_ids.size()) return std::nullopt;
+
+    std::vector<std::vector<unsigned char>> binaries(count);
+    std::vector<size_t> sizes(count);
+    std::vector<const unsigned char *> pointers(count);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t size = 0;
+        file.read(reinterpret_cast<char *>(&size), sizeof(size));
+        if (!file || size == 0) return std::nullopt;
+        binaries[i].resize(size);
+        file.read(reinterpret_cast<char *>(binaries[i].data()), std::streamsize(size));
+        if (!file) return std::nullopt;
+        sizes[i]    = size_t(size);
+        pointers[i] = binaries[i].data();
+    }
+
+    std::vector<cl_int> binary_status(count, CL_SUCCESS);
+    cl_int error        = CL_SUCCESS;
+    cl_program program_ = clCreateProgramWithBinary(
+        Context.get(),
+        cl_uint(count),
+        device_ids.data(),
+        sizes.data(),
+        pointers.data(),
+        binary_status.data(),
+        &error
+    );
+    if (!program_) return std::nullopt;
+    program prog(program_, false);  // Released with prog if the binaries are rejected
+    if (error != CL_SUCCESS) return std::nullopt;
+    for (auto &status : binary_status)
+        if (status != CL_SUCCESS) return std::nullopt;
+    return prog;
+}
+
+void SaveProgramBinary(const Path &path, const program &prog) {
+    std::vector<size_t> sizes = prog.get_info<std::vector<size_t>>(CL_PROGRAM_BINARY_SIZES);
+    std::vector<std::vector<unsigned char>> binaries(sizes.size());
+    std::vector<unsigned char *> pointers(sizes.size());
+    for (size_t i = 0; i < sizes.size(); i++) {
+        if (sizes[i] == 0) return;  // Nothing worth caching for this device
+        binaries[i].resize(sizes[i]);
+        pointers[i] = binaries[i].data();
+    }
+    cl_int error = clGetProgramInfo(
+        prog.get(),
+        CL_PROGRAM_BINARIES,
+        pointers.size() * sizeof(unsigned char *),
+        pointers.data(),
+        nullptr
+    );
+    if (error != CL_SUCCESS) return;
+
+    // Write beside the destination then rename so concurrent runs never read a partial file, the
+    // name is unique so they never write the same one either
+    std::random_device random;
+    Path temporary = path;
+    temporary += fmt::format(".{}.{:08x}{:08x}.tmp", getpid(), random(), random());
+    bool written = false;
+    {
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        if (!file) return;
+        uint64_t count = binaries.size();
+        file.write(reinterpret_cast<const char *>(&count), sizeof(count));
+        for (auto &binary : binaries) {
+            uint64_t size = binary.size();
+            file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+            file.write(reinterpret_cast<const char *>(binary.data()), std::streamsize(size));
+        }
+        written = bool(file);
+    }
+    if (written) std::filesystem::rename(temporary, path);
+    else std::filesystem::remove(temporary);
+}
+
+program BuildProgram(const std::string &source, const std::string &options) {
+    Path directory = ProgramCacheDirectory();
+    Path cache_path;
+    if (!directory.empty()) {
+        try {
+            if (PrivateDirectory(directory))
+                cache_path = directory / (ProgramCacheKey(source, options) + ".bin");
+            else
+                Log::warning(
+                    "OpenCL program cache is not private to this user, not using it: {}",
+                    directory.string()
+                );
+        } catch (...) {
+            Log::warning("OpenCL program cache is unusable: {}", directory.string());
+        }
+    }
+    if (!cache_path.empty()) {
+        try {
+            std::optional<program> cached = LoadProgramBinary(cache_path);
+            if (cached.has_value()) {
+                cached->build(options);
+                return cached.value();
+            }
+        } catch (...) {
+            Log::warning("Cached OpenCL program is unusable, rebuilding: {}", cache_path.string());
+        }
+    }
+
+    program prog = program::create_with_source(source, Context);
+    prog.build(options);
+
+    if (!cache_path.empty()) {
+        try {
+            SaveProgramBinary(cache_path, prog);
+        } catch (...) {
+            Log::warning("Failed to cache OpenCL program: {}", cache_path.string());
+        }
+    }
+    return prog;
+}
 
-void InitMainContext() {
-    auto platforms = system::platforms();
-    Context        = context(platforms[0].devices());
-    CommandQueue   = command_queue(Context, Context.get_devices()[0]);
+program SharedProgram(const std::string &source, const std::string &options) {
+    std::lock_guard<std::mutex> lock(ProgramMutex);
+    std::string key = options + "\n" + source;
+    auto it         = Programs.find(key);
+    if (it == Programs.end()) it = Programs.insert({key, BuildProgram(source, options)}).first;
+    return it->second;
 }
 
 std::string PlatformAndDeviceInfo() {
@@ -1,14 +1,50 @@
 #pragma once
 #include <string>
+#include <vector>
 
 #include <boost/compute/cl.hpp>
 #include <boost/compute/core.hpp>
 
+#include "types.h"
+
 namespace ComputeEnvironment {
 extern boost::compute::context Context;
+// Queue of the first selected device, used when no queue is explicitly scheduled
 extern boost::compute::command_queue CommandQueue;
+// One queue per selected device (or sub-device), in context device order
+extern std::vector<boost::compute::command_queue> CommandQueues;
 
+struct DeviceSelection {
+    std::string platform = "";    // Platform index or part of its name, empty for the first
+    std::string device   = "";    // Device index or part of its name, empty for all
+    std::string type     = "all"; // One of "all", "gpu", "cpu" or "accelerator"
+    unsigned int subDevices = 0u; // Split each CPU device into this many sub-devices, 0 to keep
+};
 void InitMainContext();
+void InitMainContext(const DeviceSelection &selection);
+
+// Scheduling over CommandQueues, AcquireQueue returns the index of the least busy queue
+size_t AcquireQueue();
+void ReleaseQueue(size_t index);
+void RecordWork(const boost::compute::command_queue &queue, size_t pixels, double seconds);
+
+struct DeviceThroughput {
+    std::string name;
+    unsigned int jobs = 0u;
+    size_t pixels     = 0u;
+    double seconds    = 0.;
+    double megaPixelsPerSecond() const;
+};
+std::vector<DeviceThroughput> Throughput();
+std::string ThroughputReport();
+
+// Built programs are cached on disk, keyed by the devices, their driver versions and the source.
+// An empty directory disables the cache.
+void SetProgramCacheDirectory(Path directory);
+Path ProgramCacheDirectory();
+boost::compute::program BuildProgram(const std::string &source, const std::string &options = "");
+// Built once per context and shared between threads, kernels made from it must not be shared
+boost::compute::program SharedProgram(const std::string &source, const std::string &options = "");
 
 std::string PlatformAndDeviceInfo();
 }  // namespace ComputeEnvironment
@@ -109,26 +109,31 @@ bool Functions::inXY(Quad q, glm::vec2 p) {
 
 bool Functions::in(Quad q, glm::vec3 p) { return false; }
 
-Pixels Functions::border(Pixels p) {
-    std::shared_ptr<ImageBool> map = std::make_shared<ImageBool>(
-        p.bounds.p1.y - p.bounds.p0.y + 1, p.bounds.p1.x - p.bounds.p0.x + 1
-    );
-    map->fill(false);
-#define set(i, j, v) map->operator()(j - p.bounds.p0.y, i - p.bounds.p0.x) = v;
-#define get(i, j) map->operator()(j - p.bounds.p0.y, i - p.bounds.p0.x);
-    for (auto &pix : p.list)
-        set(pix.x, pix.y, true);
-    Pixels ret;
-    ret.id     = p.id;
-    ret.bounds = p.bounds;
-    for (auto &pix : p.list) {
-        bool v_up    = get(pix.x, (unsigned int)(std::min(int(pix.y) + 1, int(p.bounds.p1.y))));
-        bool v_down  = get(pix.x, (unsigned int)(std::max(int(pix.y) - 1, int(p.bounds.p0.y))));
-        bool v_left  = get((unsigned int)(std::max(int(pix.x) - 1, int(p.bounds.p0.x))), pix.y);
-        bool v_right = get((unsigned int)(std::min(int(pix.x) + 1, int(p.bounds.p1.x))), pix.y);
-        bool edge = (pix.x == p.bounds.p0.x) || (pix.y == p.bounds.p0.y) || (pix.x == p.bounds.p1.x)
-            || (pix.y == p.bounds.p1.y);
-        if ((!v_up) || (!v_down) || (!v_left) || (!v_right) || edge) ret.list.push_back(pix);
+std::vector<glm::uvec2>
+Functions::border(const ImageBounds &bounds, std::span<const PixelRun> runs) {
+    // A pixel is on the border if it ends its run, lies on the bounds or has no pixel above or
+    // below it. Runs are ordered by j, so the runs of the neighbouring js are found as we go
+    std::vector<glm::uvec2> ret;
+    size_t below = 0u, above = 0u;
+    for (size_t r = 0; r < runs.size(); r++) {
+        const PixelRun &run = runs[r];
+        while (below < runs.size() && runs[below].j + 1u < run.j)
+            below++;
+        while (above < runs.size() && runs[above].j <= run.j)
+            above++;
+        bool edge = run.j == bounds.p0.y || run.j == bounds.p1.y;
+        // Next candidate runs in i of the j below and above
+        size_t b = below, a = above;
+        for (unsigned int i = run.i0; i <= run.i1; i++) {
+            while (b < runs.size() && runs[b].j + 1u == run.j && runs[b].i1 < i)
+                b++;
+            while (a < runs.size() && runs[a].j == run.j + 1u && runs[a].i1 < i)
+                a++;
+            bool v_down = b < runs.size() && runs[b].j + 1u == run.j && runs[b].i0 <= i;
+            bool v_up   = a < runs.size() && runs[a].j == run.j + 1u && runs[a].i0 <= i;
+            if (edge || i == run.i0 || i == run.i1 || !v_down || !v_up)
+                ret.push_back(glm::uvec2(i, run.j));
+        }
     }
     return ret;
 }
@@ -36,7 +36,7 @@ namespace Functions {
 	bool inXY(Quad q, glm::vec2 p);
 	bool in(Quad q, glm::vec3 p);
 
-	Pixels border(Pixels p);
+	std::vector<glm::uvec2> border(const ImageBounds &bounds, std::span<const PixelRun> runs);
 	float quadraticRadialBasis(float d, float min, float max, float percent);
 
 	float pixelDistance(glm::uvec2 p0, glm::uvec2 p1);
@@ -2,11 +2,13 @@
 
 #include "ComputeEnvironment.h"
 #include "Functions.h"
+#include "ImagePool.h"
 
 #define _USE_MATH_DEFINES
 #include <boost/compute/container/vector.hpp>
 #include <boost/compute/core.hpp>
 #include <boost/compute/utility/source.hpp>
+#include <chrono>
 #include <math.h>
 
 #include "boilerplate/Log.h"
@@ -16,12 +18,6 @@ using namespace ComputeEnvironment;
 using namespace Functions;
 
 namespace GaussianBlur {
-program Program;
-kernel KernelVertical;
-kernel KernelHorizontal;
-vector<float> image1;
-vector<float> kernel_strip;
-vector<float> image2;
 
 const char cl_kernal_code[] = BOOST_COMPUTE_STRINGIZE_SOURCE(
     int reflect(int v, int end) { return (v < 0)   ? -v
@@ -78,14 +74,14 @@ const char cl_kernal_code[] = BOOST_COMPUTE_STRINGIZE_SOURCE(
 
 );
 
-void init() {
+GaussianBlurContext::GaussianBlurContext(command_queue queue)
+    : queue(queue) {
     try {
-        Program = program::create_with_source(cl_kernal_code, ComputeEnvironment::Context);
-        Program.build();
+        program Program  = SharedProgram(cl_kernal_code);
         KernelVertical   = kernel(Program, "Gaussian1DVertical");
         KernelHorizontal = kernel(Program, "Gaussian1DHorizontal");
-        image1           = vector<float>(1, Context);
-        image2           = vector<float>(1, Context);
+        image1           = vector<float>(1, queue.get_context());
+        image2           = vector<float>(1, queue.get_context());
     } catch (opencl_error error) {
         Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
     }
@@ -107,19 +103,21 @@ std::vector<float> StripKernel(float sigma) {
     return kernel_cpu;
 }
 
-std::shared_ptr<ImageFloat> GaussianBlurFilter(std::shared_ptr<ImageFloat> in, float sigma) {
+std::shared_ptr<ImageFloat>
+GaussianBlurFilter(GaussianBlurContext &context, std::shared_ptr<ImageFloat> in, float sigma) {
+    auto start = std::chrono::steady_clock::now();
     // Size the data properly and/or upload
-    if (image1.size() != in->size()) {
-        image1 = vector<float>(in->size(), Context);
-        image2 = vector<float>(in->size(), Context);
+    if (context.image1.size() != in->size()) {
+        context.image1 = vector<float>(in->size(), context.queue.get_context());
+        context.image2 = vector<float>(in->size(), context.queue.get_context());
     }
-    copy(in->data(), in->data() + in->size(), image1.begin(), CommandQueue);
+    copy(in->data(), in->data() + in->size(), context.image1.begin(), context.queue);
 
     // Generate our kernel (1D)
     std::vector<float> kernel_cpu = StripKernel(sigma);
-    if (kernel_strip.size() != kernel_cpu.size())
-        kernel_strip = vector<float>(kernel_cpu.size(), Context);
-    copy(kernel_cpu.begin(), kernel_cpu.end(), kernel_strip.begin(), CommandQueue);
+    if (context.kernel_strip.size() != kernel_cpu.size())
+        context.kernel_strip = vector<float>(kernel_cpu.size(), context.queue.get_context());
+    copy(kernel_cpu.begin(), kernel_cpu.end(), context.kernel_strip.begin(), context.queue);
 
     // Define our compute sizes
     const size_t global_work_size[2]
@@ -128,39 +126,44 @@ std::shared_ptr<ImageFloat> GaussianBlurFilter(std::shared_ptr<ImageFloat> in, f
 
     // Horizontal
     try {
-        KernelHorizontal.set_arg(0, image1.get_buffer());
-        KernelHorizontal.set_arg(1, int(in->cols()));
-        KernelHorizontal.set_arg(2, int(in->rows()));
-        KernelHorizontal.set_arg(3, kernel_strip.get_buffer());
-        KernelHorizontal.set_arg(4, int(kernel_cpu.size()) - 1);
-        KernelHorizontal.set_arg(5, image2.get_buffer());
-        CommandQueue.enqueue_nd_range_kernel(
-            KernelHorizontal, 2, 0, global_work_size, local_work_size
+        context.KernelHorizontal.set_arg(0, context.image1.get_buffer());
+        context.KernelHorizontal.set_arg(1, int(in->cols()));
+        context.KernelHorizontal.set_arg(2, int(in->rows()));
+        context.KernelHorizontal.set_arg(3, context.kernel_strip.get_buffer());
+        context.KernelHorizontal.set_arg(4, int(kernel_cpu.size()) - 1);
+        context.KernelHorizontal.set_arg(5, context.image2.get_buffer());
+        context.queue.enqueue_nd_range_kernel(
+            context.KernelHorizontal, 2, 0, global_work_size, local_work_size
         );
-        CommandQueue.finish();
+        context.queue.finish();
     } catch (opencl_error error) {
         Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
     }
 
     // Vertical
     try {
-        KernelVertical.set_arg(0, image2.get_buffer());
-        KernelVertical.set_arg(1, int(in->cols()));
-        KernelVertical.set_arg(2, int(in->rows()));
-        KernelVertical.set_arg(3, kernel_strip.get_buffer());
-        KernelVertical.set_arg(4, int(kernel_cpu.size()) - 1);
-        KernelVertical.set_arg(5, image1.get_buffer());
-        CommandQueue.enqueue_nd_range_kernel(
-            KernelVertical, 2, 0, global_work_size, local_work_size
+        context.KernelVertical.set_arg(0, context.image2.get_buffer());
+        context.KernelVertical.set_arg(1, int(in->cols()));
+        context.KernelVertical.set_arg(2, int(in->rows()));
+        context.KernelVertical.set_arg(3, context.kernel_strip.get_buffer());
+        context.KernelVertical.set_arg(4, int(kernel_cpu.size()) - 1);
+        context.KernelVertical.set_arg(5, context.image1.get_buffer());
+        context.queue.enqueue_nd_range_kernel(
+            context.KernelVertical, 2, 0, global_work_size, local_work_size
         );
-        CommandQueue.finish();
+        context.queue.finish();
     } catch (opencl_error error) {
         Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
     }
 
     // Return value
-    std::shared_ptr<ImageFloat> ret = std::make_shared<ImageFloat>(in->rows(), in->cols());
-    copy(image1.begin(), image1.end(), ret->data(), CommandQueue);
+    std::shared_ptr<ImageFloat> ret = ImagePool::Make<float>(in->rows(), in->cols());
+    copy(context.image1.begin(), context.image1.end(), ret->data(), context.queue);
+    RecordWork(
+        context.queue,
+        size_t(in->size()),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+    );
     return ret;
 }
 }  // namespace GaussianBlur
\ No newline at end of file
@@ -3,10 +3,23 @@
 #include <memory>
 #include <vector>
 
+#include <boost/compute/container/vector.hpp>
+#include <boost/compute/core.hpp>
+
 #include "types.h"
 
 namespace GaussianBlur {
-void init();
+// Kernels and scratch buffers bound to one queue, only one thread may use a context at a time
+struct GaussianBlurContext {
+    explicit GaussianBlurContext(boost::compute::command_queue queue);
+    boost::compute::command_queue queue;
+    boost::compute::kernel KernelVertical;
+    boost::compute::kernel KernelHorizontal;
+    boost::compute::vector<float> image1;
+    boost::compute::vector<float> kernel_strip;
+    boost::compute::vector<float> image2;
+};
 std::vector<float> StripKernel(float sigma);
-std::shared_ptr<ImageFloat> GaussianBlurFilter(std::shared_ptr<ImageFloat> in, float sigma);
+std::shared_ptr<ImageFloat>
+GaussianBlurFilter(GaussianBlurContext &context, std::shared_ptr<ImageFloat> in, float sigma);
 };  // namespace GaussianBlur
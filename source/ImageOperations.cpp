@@ -1,54 +1,48 @@
+#include <algorithm>
 #include <queue>
 
 #include "ImageOperations.h"
 
 namespace ImageOperations {
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageFloat> A, float threshold) {
-    std::shared_ptr<ImageBool> ret = std::make_shared<ImageBool>(A->rows(), A->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i] = A->data()[i] >= threshold;
-    return ret;
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageFloat> &A, float threshold) {
+    return evaluate(Threshold(lazy(A), threshold));
 }
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageInt> A, int threshold) {
-    std::shared_ptr<ImageBool> ret = std::make_shared<ImageBool>(A->rows(), A->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i] = A->data()[i] >= threshold;
-    return ret;
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageInt> &A, int threshold) {
+    return evaluate(Threshold(lazy(A), threshold));
 }
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageUint> A, unsigned int threshold) {
-    std::shared_ptr<ImageBool> ret = std::make_shared<ImageBool>(A->rows(), A->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i] = A->data()[i] >= threshold;
-    return ret;
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageUint> &A, unsigned int threshold) {
+    return evaluate(Threshold(lazy(A), threshold));
 }
 
-std::shared_ptr<ImageBool> NOT(std::shared_ptr<ImageBool> A) {
-    std::shared_ptr<ImageBool> ret = std::make_shared<ImageBool>(A->rows(), A->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i] = !A->data()[i];
-    return ret;
+std::shared_ptr<ImageBool> NOT(const std::shared_ptr<ImageBool> &A) {
+    return evaluate(NOT(lazy(A)));
 }
-std::shared_ptr<ImageBool> AND(std::shared_ptr<ImageBool> A, std::shared_ptr<ImageBool> B) {
+std::shared_ptr<ImageBool>
+AND(const std::shared_ptr<ImageBool> &A, const std::shared_ptr<ImageBool> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageBool>(A->array().min(B->array()));
+    return evaluate(AND(lazy(A), lazy(B)));
 }
-std::shared_ptr<ImageBool> OR(std::shared_ptr<ImageBool> A, std::shared_ptr<ImageBool> B) {
+std::shared_ptr<ImageBool>
+OR(const std::shared_ptr<ImageBool> &A, const std::shared_ptr<ImageBool> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageBool>(A->array().max(B->array()));
+    return evaluate(OR(lazy(A), lazy(B)));
 }
 std::vector<glm::uvec2>
-flood(std::shared_ptr<ImageBool> A, unsigned int i_start, unsigned int j_start) {
+flood(const std::shared_ptr<ImageBool> &A, unsigned int i_start, unsigned int j_start) {
     std::queue<glm::uvec2> queue;
     queue.push(glm::uvec2(i_start, j_start));
     glm::uvec2 current;
     std::vector<glm::uvec2> pixelList;
-    std::shared_ptr<ImageBool> used = std::make_shared<ImageBool>(A->rows(), A->cols());
-    used->fill(false);
+    const ImageBool &mask = *A;
+    // Taken from the pool, flood runs once per cloud over the whole scene
+    std::shared_ptr<ImageBool> scratch = ImagePool::Make<bool>(A->rows(), A->cols());
+    ImageBool &used                    = *scratch;
+    used.fill(false);
     set(used, i_start, j_start, true);
     do {
         current = queue.front();
         queue.pop();
-        if (at(A, current.x, current.y)) {
+        if (at(mask, current.x, current.y)) {
             pixelList.push_back(current);
             for (int i = std::max(0, int(current.x) - 1);
                  i < std::min(int(A->cols()), int(current.x) + 2);
@@ -66,58 +60,151 @@ flood(std::shared_ptr<ImageBool> A, unsigned int i_start, unsigned int j_start)
     } while (!queue.empty());
     return pixelList;
 }
+std::vector<PixelRun> encodeRuns(std::vector<glm::uvec2> pixels) {
+    std::sort(pixels.begin(), pixels.end(), [](glm::uvec2 a, glm::uvec2 b) {
+        return a.y < b.y || (a.y == b.y && a.x < b.x);
+    });
+    std::vector<PixelRun> ret;
+    for (auto &p : pixels) {
+        if (!ret.empty() && ret.back().j == p.y && ret.back().i1 + 1u == p.x) ret.back().i1 = p.x;
+        else ret.push_back({p.y, p.x, p.x});
+    }
+    return ret;
+}
+BitImage pack(const std::shared_ptr<ImageBool> &A) {
+    BitImage ret(unsigned(A->cols()), unsigned(A->rows()));
+    for (unsigned int j = 0; j < ret.height; j++)
+        for (unsigned int i = 0; i < ret.width; i++)
+            if (at(*A, i, j)) ret.set(i, j);
+    return ret;
+}
+glm::ivec2
+mappedSpan(const AffinePixelMap &map, int j, ImageBounds bounds, int i_begin, int i_end) {
+    glm::vec2 base = map(0, j);
+    float first    = float(i_begin);
+    float last     = float(i_end);
+    // Solve lo <= base + i * di < hi on each axis
+    for (int k = 0; k < 2; k++) {
+        float lo = float(bounds.p0[k]) - base[k];
+        float hi = float(bounds.p1[k]) + 1.f - base[k];
+        float d  = map.di[k];
+        if (d == 0.f) {
+            if (lo > 0.f || hi <= 0.f) return {i_begin, i_begin};
+            continue;
+        }
+        first = std::max(first, std::min(lo / d, hi / d) - 1.f);
+        last  = std::min(last, std::max(lo / d, hi / d) + 2.f);
+    }
+    if (!(first < last)) return {i_begin, i_begin};
+    return {int(floorf(first)), int(ceilf(last))};
+}
+std::shared_ptr<ImageFloat>
+fillHoles(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageBool> &valid) {
+    if (!DIM_CHECK(A, valid)) return nullptr;
+    std::shared_ptr<ImageFloat> ret = clone(A);
+    ImageFloat &out                 = *ret;
+    ImageBool filled                = *valid;
+    ImageBool reached               = *valid;
+    int cols = int(A->cols()), rows = int(A->rows());
+    auto neighbours = [&](glm::ivec2 p, auto f) {
+        for (int i = std::max(0, p.x - 1); i < std::min(cols, p.x + 2); i++)
+            for (int j = std::max(0, p.y - 1); j < std::min(rows, p.y + 2); j++)
+                if (i != p.x || j != p.y) f(i, j);
+    };
+    // Every pixel joins a wave at most once, so the fill is linear in the image size
+    std::vector<glm::ivec2> wave, next;
+    auto reach = [&](int i, int j) {
+        if (at(reached, i, j)) return;
+        set(reached, i, j, true);
+        next.push_back({i, j});
+    };
+    for (int i = 0; i < cols; i++)
+        for (int j = 0; j < rows; j++)
+            if (at(*valid, i, j)) neighbours({i, j}, reach);
 
-std::shared_ptr<ImageFloat> MIN(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B) {
+    std::vector<float> values;
+    while (!next.empty()) {
+        wave.swap(next);
+        next.clear();
+        values.resize(wave.size());
+        for (size_t k = 0; k < wave.size(); k++) {
+            float accum = 0.f, totalWeight = 0.f;
+            neighbours(wave[k], [&](int i, int j) {
+                if (!at(filled, i, j)) return;
+                int di = i - wave[k].x, dj = j - wave[k].y;
+                float weight = 1.f / float(di * di + dj * dj);
+                accum += weight * at(out, i, j);
+                totalWeight += weight;
+            });
+            values[k] = accum / totalWeight;
+        }
+        for (size_t k = 0; k < wave.size(); k++) {
+            set(out, wave[k].x, wave[k].y, values[k]);
+            set(filled, wave[k].x, wave[k].y, true);
+        }
+        for (auto &p : wave)
+            neighbours(p, reach);
+    }
+    return ret;
+}
+
+std::shared_ptr<ImageFloat>
+MIN(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageFloat>(A->array().min(B->array()));
+    return evaluate(MIN(lazy(A), lazy(B)));
 }
-std::shared_ptr<ImageFloat> MAX(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B) {
+std::shared_ptr<ImageFloat>
+MAX(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageFloat>(A->array().max(B->array()));
+    return evaluate(MAX(lazy(A), lazy(B)));
 }
-std::shared_ptr<ImageFloat> ADD(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B) {
+std::shared_ptr<ImageFloat>
+ADD(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageFloat>((*A) + (*B));
+    return evaluate(ADD(lazy(A), lazy(B)));
 }
-std::shared_ptr<ImageFloat> SUBTRACT(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B) {
+std::shared_ptr<ImageFloat>
+SUBTRACT(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageFloat>((*A) - (*B));
+    return evaluate(SUBTRACT(lazy(A), lazy(B)));
 }
-std::shared_ptr<ImageFloat> DIVIDE(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B) {
+std::shared_ptr<ImageFloat>
+DIVIDE(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageFloat>((*A).cwiseQuotient(*B));
+    return evaluate(lazy(A) / lazy(B));
 }
-std::shared_ptr<ImageFloat> NEGATE(std::shared_ptr<ImageFloat> A) {
-    return std::make_shared<ImageFloat>(-(*A));
+std::shared_ptr<ImageFloat> NEGATE(const std::shared_ptr<ImageFloat> &A) {
+    return evaluate(-lazy(A));
 }
 
-std::shared_ptr<ImageUint> ADD(std::shared_ptr<ImageUint> A, std::shared_ptr<ImageUint> B) {
+std::shared_ptr<ImageUint>
+ADD(const std::shared_ptr<ImageUint> &A, const std::shared_ptr<ImageUint> &B) {
     if (!DIM_CHECK(A, B)) return nullptr;
-    return std::make_shared<ImageUint>((*A) + (*B));
+    return evaluate(ADD(lazy(A), lazy(B)));
 }
 
-std::shared_ptr<ImageFloat> normalize(std::shared_ptr<ImageUint> A, unsigned int max) {
-    return std::make_shared<ImageFloat>(A->cast<float>() / float(max));
+std::shared_ptr<ImageFloat> normalize(const std::shared_ptr<ImageUint> &A, unsigned int max) {
+    return evaluate(lazy(A).cast<float>() / float(max));
 }
-std::shared_ptr<ImageFloat> normalize(std::shared_ptr<ImageInt> A, int max) {
-    return std::make_shared<ImageFloat>(A->cast<float>() / float(max));
+std::shared_ptr<ImageFloat> normalize(const std::shared_ptr<ImageInt> &A, int max) {
+    return evaluate(lazy(A).cast<float>() / float(max));
 }
-std::shared_ptr<ImageFloat> normalize(std::shared_ptr<ImageFloat> A, float max) {
-    return std::make_shared<ImageFloat>(*A / max);
+std::shared_ptr<ImageFloat> normalize(const std::shared_ptr<ImageFloat> &A, float max) {
+    return evaluate(lazy(A) / max);
 }
-std::shared_ptr<ImageFloat> toDegrees(std::shared_ptr<ImageFloat> A) {
-    std::shared_ptr<ImageFloat> ret = std::make_shared<ImageFloat>(A->rows(), A->cols());
+std::shared_ptr<ImageFloat> toDegrees(const std::shared_ptr<ImageFloat> &A) {
+    std::shared_ptr<ImageFloat> ret = ImagePool::Make<float>(A->rows(), A->cols());
     for (int i = 0; i < ret->size(); i++)
         ret->data()[i] = glm::degrees(A->data()[i]);
     return ret;
 }
-std::shared_ptr<ImageFloat> toRadians(std::shared_ptr<ImageFloat> A) {
-    std::shared_ptr<ImageFloat> ret = std::make_shared<ImageFloat>(A->rows(), A->cols());
+std::shared_ptr<ImageFloat> toRadians(const std::shared_ptr<ImageFloat> &A) {
+    std::shared_ptr<ImageFloat> ret = ImagePool::Make<float>(A->rows(), A->cols());
     for (int i = 0; i < ret->size(); i++)
         ret->data()[i] = glm::radians(A->data()[i]);
     return ret;
 }
-std::vector<float> decomposeRBGA(std::shared_ptr<ImageUint> A) {
+std::vector<float> decomposeRBGA(const std::shared_ptr<ImageUint> &A) {
     std::vector<float> ret(A->size() * 4);
     for (size_t i = 0; i < size_t(A->size()); i++) {
         ret[4 * i + 0]
@@ -131,7 +218,7 @@ std::vector<float> decomposeRBGA(std::shared_ptr<ImageUint> A) {
     }
     return ret;
 }
-std::vector<uint8_t> decomposeRBGA256(std::shared_ptr<ImageUint> A) {
+std::vector<uint8_t> decomposeRBGA256(const std::shared_ptr<ImageUint> &A) {
     std::vector<uint8_t> ret(A->size() * 4);
     for (size_t i = 0; i < size_t(A->size()); i++) {
         ret[4 * i + 0] = uint8_t((A->data()[i] >> 0) & 0xff);
@@ -141,19 +228,21 @@ std::vector<uint8_t> decomposeRBGA256(std::shared_ptr<ImageUint> A) {
     }
     return ret;
 }
-unsigned int CoverCount(std::shared_ptr<ImageBool> A) { return A->cast<unsigned int>().sum(); }
-float CoverPercentage(std::shared_ptr<ImageBool> A) {
+unsigned int CoverCount(const std::shared_ptr<ImageBool> &A) {
+    return A->cast<unsigned int>().sum();
+}
+float CoverPercentage(const std::shared_ptr<ImageBool> &A) {
     return A->cast<float>().sum() / float(A->size());
 }
 
-unsigned int SubCoverCount(std::shared_ptr<ImageBool> A, ImageBounds bounds) {
+unsigned int SubCoverCount(const std::shared_ptr<ImageBool> &A, ImageBounds bounds) {
     unsigned int count = 0u;
     for (size_t i = std::max(0u, bounds.p0.x); i < std::min(glm::u32(A->cols() - 1u), bounds.p1.x);
          i++) {
         for (size_t j = std::max(0u, bounds.p0.y);
              j < std::min(glm::u32(A->rows() - 1u), bounds.p1.y);
              j++) {
-            if (at(A, i, j)) count++;
+            if (at(*A, i, j)) count++;
         }
     }
     return count;
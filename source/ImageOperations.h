@@ -1,86 +1,172 @@
 #pragma once
+#include <algorithm>
 #include <memory>
 
+#include "ImagePool.h"
+#include "Parallel.h"
 #include "types.h"
 
 namespace ImageOperations {
 #ifndef IMAGE_OPERATIONS_TEMPLATES
 #    define IMAGE_OPERATIONS_TEMPLATES
 
-template<class T>
-bool valid(std::shared_ptr<Image<T>> A, size_t i, size_t j) {
-    return ((i >= 0) && (i < A->cols())) && ((j >= 0) && (j < A->rows()));
+// The per-pixel helpers take any dense view of an image, a whole Image, a block or a Map, so the
+// inner loops index through a reference rather than copying the owning shared_ptr per pixel
+template<class Derived>
+bool valid(const Eigen::DenseBase<Derived> &A, size_t i, size_t j) {
+    return ((i >= 0) && (i < A.cols())) && ((j >= 0) && (j < A.rows()));
 }
-template<class T>
-T at(std::shared_ptr<Image<T>> A, size_t i, size_t j) {
-    return (*A)(A->rows() - 1 - j, i);
+template<class Derived>
+typename Derived::Scalar at(const Eigen::DenseBase<Derived> &A, size_t i, size_t j) {
+    return A(A.rows() - 1 - j, i);
 }
-template<class T>
-void set(std::shared_ptr<Image<T>> A, size_t i, size_t j, T v) {
-    (*A)(A->rows() - 1 - j, i) = v;
+template<class Derived>
+void set(Eigen::DenseBase<Derived> &A, size_t i, size_t j, typename Derived::Scalar v) {
+    A(A.rows() - 1 - j, i) = v;
 }
-template<class T>
-glm::vec2 sides(std::shared_ptr<Image<T>> A, float Diagonal) {
-    return Diagonal * glm::normalize(glm::vec2(A->cols(), A->rows()));
+template<class Derived>
+glm::vec2 sides(const Eigen::DenseBase<Derived> &A, float Diagonal) {
+    return Diagonal * glm::normalize(glm::vec2(A.cols(), A.rows()));
 }
-template<class T>
+template<class Derived>
 glm::vec3 pos(
-    std::shared_ptr<Image<T>> A,
+    const Eigen::DenseBase<Derived> &A,
     float Diagonal,
     unsigned int i,
     unsigned int j,
-    float alpha,
-    float beta
+    float alpha = .5f,
+    float beta  = .5f
 ) {
-    glm::vec2 side_lengths = sides<T>(A, Diagonal);
+    glm::vec2 side_lengths = sides(A, Diagonal);
     return {
-        side_lengths.x * (float(i) + alpha) / float(A->cols()),
-        side_lengths.y * (float(j) + beta) / float(A->rows()),
+        side_lengths.x * (float(i) + alpha) / float(A.cols()),
+        side_lengths.y * (float(j) + beta) / float(A.rows()),
         0.f};
 }
+template<class Derived>
+glm::ivec2 index(const Eigen::DenseBase<Derived> &A, float Diagonal, glm::vec2 pos) {
+    glm::vec2 side_lengths = sides(A, Diagonal);
+    return {
+        floorf(float(A.cols()) * pos.x / side_lengths.x),
+        floorf(float(A.rows()) * pos.y / side_lengths.y)};
+}
+
+// Continuous pixel coordinates in B of the pixels of A moved by the affine world space map M, which
+// stays affine in pixels so column i and row j of A land at origin + i * di + j * dj
+struct AffinePixelMap {
+    glm::vec2 origin;
+    glm::vec2 di;
+    glm::vec2 dj;
+    glm::vec2 operator()(int i, int j) const { return origin + float(i) * di + float(j) * dj; }
+};
+template<class T, class Y>
+AffinePixelMap affinePixelMap(
+    const std::shared_ptr<Image<T>> &A,
+    const std::shared_ptr<Image<Y>> &B,
+    float Diagonal,
+    glm::mat4 M
+) {
+    glm::vec2 pixel = sides(*A, Diagonal) / glm::vec2(A->cols(), A->rows());
+    glm::vec2 scale = glm::vec2(B->cols(), B->rows()) / sides(*B, Diagonal);
+    return {
+        scale * glm::vec2(M * glm::vec4(.5f * pixel, 0.f, 1.f)),
+        scale * glm::vec2(M * glm::vec4(pixel.x, 0.f, 0.f, 0.f)),
+        scale * glm::vec2(M * glm::vec4(0.f, pixel.y, 0.f, 0.f))};
+}
+// Gathers B at the mapped pixels of column i of A for the rows [j_begin, j_end), outside where
+// they fall off B
 template<class T>
-glm::vec3 pos(std::shared_ptr<Image<T>> A, float Diagonal, unsigned int i, unsigned int j) {
-    return pos<T>(A, Diagonal, i, j, .5f, .5f);
+void sampleColumn(
+    const std::shared_ptr<Image<T>> &B,
+    const AffinePixelMap &map,
+    int i,
+    int j_begin,
+    int j_end,
+    T outside,
+    T *out
+) {
+    int cols       = int(B->cols());
+    int rows       = int(B->rows());
+    const T *data  = B->data();
+    glm::vec2 base = map(i, 0);
+    // Branch free so the loop can become a vector gather
+    for (int j = j_begin; j < j_end; j++) {
+        int x            = int(floorf(base.x + float(j) * map.dj.x));
+        int y            = int(floorf(base.y + float(j) * map.dj.y));
+        bool inside      = x >= 0 && x < cols && y >= 0 && y < rows;
+        size_t index     = inside ? size_t(rows - 1 - y) * cols + x : 0;
+        out[j - j_begin] = inside ? data[index] : outside;
+    }
 }
+// Gathers B at the mapped pixels of row j of A for the columns [i_begin, i_end), outside where
+// they fall off B
 template<class T>
-glm::ivec2 index(std::shared_ptr<Image<T>> A, float Diagonal, glm::vec2 pos) {
-    glm::vec2 side_lengths = sides<T>(A, Diagonal);
-    return {
-        floorf(float(A->cols()) * pos.x / side_lengths.x),
-        floorf(float(A->rows()) * pos.y / side_lengths.y)};
+void sampleRow(
+    const std::shared_ptr<Image<T>> &B,
+    const AffinePixelMap &map,
+    int j,
+    int i_begin,
+    int i_end,
+    T outside,
+    T *out
+) {
+    int cols       = int(B->cols());
+    int rows       = int(B->rows());
+    const T *data  = B->data();
+    glm::vec2 base = map(0, j);
+    // Branch free so the loop can become a vector gather
+    for (int i = i_begin; i < i_end; i++) {
+        int x            = int(floorf(base.x + float(i) * map.di.x));
+        int y            = int(floorf(base.y + float(i) * map.di.y));
+        bool inside      = x >= 0 && x < cols && y >= 0 && y < rows;
+        size_t index     = inside ? size_t(rows - 1 - y) * cols + x : 0;
+        out[i - i_begin] = inside ? data[index] : outside;
+    }
 }
+// Columns [x, y) of row j, within [i_begin, i_end), that can map into the pixel bounds of B, a
+// pixel wider on each side than the exact span, empty when the row misses them
+glm::ivec2 mappedSpan(const AffinePixelMap &map, int j, ImageBounds bounds, int i_begin, int i_end);
 
 template<class T, class Y>
-bool DIM_CHECK(std::shared_ptr<Image<T>> A, std::shared_ptr<Image<Y>> B) {
+bool DIM_CHECK(const std::shared_ptr<Image<T>> &A, const std::shared_ptr<Image<Y>> &B) {
     return (A->rows() == B->rows()) && (A->cols() == B->cols());
 }
 template<class ReturnType, class SourceType>
-std::shared_ptr<Image<ReturnType>> cast(std::shared_ptr<Image<SourceType>> A) {
-    return std::make_shared<Image<ReturnType>>(A->template cast<ReturnType>());
+std::shared_ptr<Image<ReturnType>> cast(const std::shared_ptr<Image<SourceType>> &A) {
+    std::shared_ptr<Image<ReturnType>> ret = ImagePool::Make<ReturnType>(A->rows(), A->cols());
+    *ret = A->template cast<ReturnType>();
+    return ret;
 }
 template<class T>
-std::shared_ptr<Image<T>> cast(std::shared_ptr<ImageBool> A, T true_value, T false_value) {
-    std::shared_ptr<Image<T>> ret = std::make_shared<Image<T>>(A->rows(), A->cols());
+std::shared_ptr<Image<T>>
+cast(const std::shared_ptr<ImageBool> &A, T true_value, T false_value) {
+    std::shared_ptr<Image<T>> ret = ImagePool::Make<T>(A->rows(), A->cols());
     for (int i = 0; i < A->size(); i++)
         ret->data()[i] = A->data()[i] ? true_value : false_value;
     return ret;
 }
 template<class T>
-std::shared_ptr<Image<T>> clone(std::shared_ptr<Image<T>> A) {
+std::shared_ptr<Image<T>> clone(const std::shared_ptr<Image<T>> &A) {
     return cast<T, T>(A);
 }
 template<class T>
-std::shared_ptr<Image<T>>
-obscure(std::shared_ptr<Image<T>> A, std::shared_ptr<ImageBool> Mask, T replace) {
+std::shared_ptr<Image<T>> obscure(
+    const std::shared_ptr<Image<T>> &A,
+    const std::shared_ptr<ImageBool> &Mask,
+    T replace
+) {
     if (!DIM_CHECK<T, bool>(A, Mask)) return nullptr;
-    std::shared_ptr<Image<T>> ret = std::make_shared<Image<T>>(A->rows(), A->cols());
+    std::shared_ptr<Image<T>> ret = ImagePool::Make<T>(A->rows(), A->cols());
     for (int i = 0; i < ret->size(); i++)
         ret->data()[i] = Mask->data()[i] ? replace : A->data()[i];
     return ret;
 }
 template<class T>
 std::shared_ptr<std::pair<std::vector<T>, std::vector<T>>>
-partitionUnobscuredObscured(std::shared_ptr<Image<T>> A, std::shared_ptr<ImageBool> Mask) {
+partitionUnobscuredObscured(
+    const std::shared_ptr<Image<T>> &A,
+    const std::shared_ptr<ImageBool> &Mask
+) {
     if (!DIM_CHECK<T, bool>(A, Mask)) return nullptr;
     std::shared_ptr<std::pair<std::vector<T>, std::vector<T>>> ret
         = std::make_shared<std::pair<std::vector<T>, std::vector<T>>>();
@@ -90,41 +176,128 @@ partitionUnobscuredObscured(std::shared_ptr<Image<T>> A, std::shared_ptr<ImageBo
     }
     return ret;
 }
+// Sets every pixel of the runs, each a contiguous stretch of a stored row
+template<class T>
+void rasterize(const std::shared_ptr<Image<T>> &A, std::span<const PixelRun> runs, T v) {
+    for (auto &run : runs)
+        A->row(A->rows() - 1 - run.j).segment(run.i0, run.size()).setConstant(v);
+}
+
+// Lazy forms of the elementwise ops on Eigen array expressions. lazy(A) starts a chain, nothing is
+// computed until evaluate writes it, so a whole chain is one pass and one allocation
+template<class T>
+auto lazy(const std::shared_ptr<Image<T>> &A) {
+    const Image<T> &image = *A;
+    return image.array();
+}
+template<class E>
+auto Threshold(const Eigen::ArrayBase<E> &A, typename E::Scalar threshold) {
+    return A.derived() >= threshold;
+}
+template<class E>
+auto NOT(const Eigen::ArrayBase<E> &A) {
+    return !A.derived();
+}
+// min and max rather than && and ||, which branch on every pixel
+template<class E, class F>
+auto AND(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived().min(B.derived());
+}
+template<class E, class F>
+auto OR(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived().max(B.derived());
+}
+// E is only ever deduced, the default keeps explicit cast<ReturnType, SourceType> calls off this
+template<class ReturnType, class E, class = typename E::Scalar>
+auto cast(const Eigen::ArrayBase<E> &A) {
+    return A.derived().template cast<ReturnType>();
+}
+template<class T, class E>
+auto cast(const Eigen::ArrayBase<E> &A, T true_value, T false_value) {
+    return A.derived().unaryExpr([=](bool v) { return v ? true_value : false_value; });
+}
+template<class E, class F>
+auto MIN(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived().min(B.derived());
+}
+template<class E, class F>
+auto MAX(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived().max(B.derived());
+}
+template<class E, class F>
+auto ADD(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived() + B.derived();
+}
+template<class E, class F>
+auto SUBTRACT(const Eigen::ArrayBase<E> &A, const Eigen::ArrayBase<F> &B) {
+    return A.derived() - B.derived();
+}
+static const size_t EvaluateGrain = size_t(1) << 16;  // Fewest pixels worth a thread of their own
+// A new image of the expression, its rows split in blocks over the workers
+template<class E>
+std::shared_ptr<Image<typename E::Scalar>> evaluate(const Eigen::ArrayBase<E> &expression) {
+    using T = typename E::Scalar;
+    std::shared_ptr<Image<T>> ret = ImagePool::Make<T>(expression.rows(), expression.cols());
+    size_t rows   = size_t(expression.rows());
+    size_t blocks = std::max<size_t>(std::min(rows, size_t(expression.size()) / EvaluateGrain), 1);
+    Parallel::ForRanges(0, blocks, [&](unsigned int, size_t first, size_t last) {
+        Eigen::Index begin = Eigen::Index(rows * first / blocks);
+        Eigen::Index count = Eigen::Index(rows * last / blocks) - begin;
+        ret->array().middleRows(begin, count) = expression.derived().middleRows(begin, count);
+    });
+    return ret;
+}
 #endif  // !IMAGE_OPERATIONS_TEMPLATES
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageFloat> A, float threshold);
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageInt> A, int threshold);
-std::shared_ptr<ImageBool> Threshold(std::shared_ptr<ImageUint> A, unsigned int threshold);
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageFloat> &A, float threshold);
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageInt> &A, int threshold);
+std::shared_ptr<ImageBool> Threshold(const std::shared_ptr<ImageUint> &A, unsigned int threshold);
 
-std::shared_ptr<ImageBool> NOT(std::shared_ptr<ImageBool> A);
-std::shared_ptr<ImageBool> AND(std::shared_ptr<ImageBool> A, std::shared_ptr<ImageBool> B);
-std::shared_ptr<ImageBool> OR(std::shared_ptr<ImageBool> A, std::shared_ptr<ImageBool> B);
+std::shared_ptr<ImageBool> NOT(const std::shared_ptr<ImageBool> &A);
+std::shared_ptr<ImageBool>
+AND(const std::shared_ptr<ImageBool> &A, const std::shared_ptr<ImageBool> &B);
+std::shared_ptr<ImageBool>
+OR(const std::shared_ptr<ImageBool> &A, const std::shared_ptr<ImageBool> &B);
 std::vector<glm::uvec2>
-flood(std::shared_ptr<ImageBool> A, unsigned int i_start, unsigned int j_start);
+flood(const std::shared_ptr<ImageBool> &A, unsigned int i_start, unsigned int j_start);
+// The pixels as runs ordered by j then i, neighbours in i merged
+std::vector<PixelRun> encodeRuns(std::vector<glm::uvec2> pixels);
+// The mask one bit per pixel, indexed as at indexes it
+BitImage pack(const std::shared_ptr<ImageBool> &A);
+// Fills the pixels that are not valid in waves outwards from the valid ones, each taking the
+// inverse square distance weighted mean of its 8 neighbours filled by earlier waves
+std::shared_ptr<ImageFloat>
+fillHoles(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageBool> &valid);
 
-std::shared_ptr<ImageFloat> MIN(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B);
-std::shared_ptr<ImageFloat> MAX(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B);
-std::shared_ptr<ImageFloat> ADD(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B);
-std::shared_ptr<ImageFloat> SUBTRACT(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B);
-std::shared_ptr<ImageFloat> DIVIDE(std::shared_ptr<ImageFloat> A, std::shared_ptr<ImageFloat> B);
-std::shared_ptr<ImageFloat> NEGATE(std::shared_ptr<ImageFloat> A);
+std::shared_ptr<ImageFloat>
+MIN(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B);
+std::shared_ptr<ImageFloat>
+MAX(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B);
+std::shared_ptr<ImageFloat>
+ADD(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B);
+std::shared_ptr<ImageFloat>
+SUBTRACT(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B);
+std::shared_ptr<ImageFloat>
+DIVIDE(const std::shared_ptr<ImageFloat> &A, const std::shared_ptr<ImageFloat> &B);
+std::shared_ptr<ImageFloat> NEGATE(const std::shared_ptr<ImageFloat> &A);
 
-std::shared_ptr<ImageUint> ADD(std::shared_ptr<ImageUint> A, std::shared_ptr<ImageUint> B);
+std::shared_ptr<ImageUint>
+ADD(const std::shared_ptr<ImageUint> &A, const std::shared_ptr<ImageUint> &B);
 
 std::shared_ptr<ImageFloat> normalize(
-    std::shared_ptr<ImageUint> A,
+    const std::shared_ptr<ImageUint> &A,
     unsigned int max = std::numeric_limits<unsigned int>::max()
 );
 std::shared_ptr<ImageFloat>
-normalize(std::shared_ptr<ImageInt> A, int max = std::numeric_limits<int>::max());
+normalize(const std::shared_ptr<ImageInt> &A, int max = std::numeric_limits<int>::max());
 std::shared_ptr<ImageFloat>
-normalize(std::shared_ptr<ImageFloat> A, float max = std::numeric_limits<float>::max());
-std::shared_ptr<ImageFloat> toDegrees(std::shared_ptr<ImageFloat> A);
-std::shared_ptr<ImageFloat> toRadians(std::shared_ptr<ImageFloat> A);
+normalize(const std::shared_ptr<ImageFloat> &A, float max = std::numeric_limits<float>::max());
+std::shared_ptr<ImageFloat> toDegrees(const std::shared_ptr<ImageFloat> &A);
+std::shared_ptr<ImageFloat> toRadians(const std::shared_ptr<ImageFloat> &A);
 
-std::vector<float> decomposeRBGA(std::shared_ptr<ImageUint> A);
-std::vector<uint8_t> decomposeRBGA256(std::shared_ptr<ImageUint> A);
-unsigned int CoverCount(std::shared_ptr<ImageBool> A);
-float CoverPercentage(std::shared_ptr<ImageBool> A);
+std::vector<float> decomposeRBGA(const std::shared_ptr<ImageUint> &A);
+std::vector<uint8_t> decomposeRBGA256(const std::shared_ptr<ImageUint> &A);
+unsigned int CoverCount(const std::shared_ptr<ImageBool> &A);
+float CoverPercentage(const std::shared_ptr<ImageBool> &A);
 
-unsigned int SubCoverCount(std::shared_ptr<ImageBool> A, ImageBounds bounds);
+unsigned int SubCoverCount(const std::shared_ptr<ImageBool> &A, ImageBounds bounds);
 }  // namespace ImageOperations
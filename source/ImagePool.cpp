@@ -0,0 +1,141 @@
+#include "ImagePool.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <tuple>
+#include <vector>
+
+namespace ImagePool {
+using Key = std::tuple<std::type_index, Eigen::Index, Eigen::Index>;
+struct Idle {
+    size_t bytes;
+    Buffer image;
+};
+struct State {
+    std::mutex mutex;
+    std::multimap<Key, Idle> idle;
+    Statistics stats;
+    std::vector<Statistics *> open;  // Tallies of the open scenes
+    std::set<Key> requested;         // Shapes asked for since the pool was last idle
+};
+// Never destroyed, images held by other statics may come back after main returns
+State &Pool() {
+    static State *state = new State;
+    return *state;
+}
+thread_local std::shared_ptr<Statistics> Current;
+
+std::shared_ptr<Statistics> CurrentScene() { return Current; }
+
+Buffer Take(
+    std::type_index type,
+    Eigen::Index rows,
+    Eigen::Index cols,
+    size_t bytes,
+    const std::shared_ptr<Statistics> &scene
+) {
+    State &pool = Pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    Statistics &stats = pool.stats;
+    Key key           = {type, rows, cols};
+    pool.requested.insert(key);
+    stats.liveBytes += bytes;
+    stats.peakLiveBytes = std::max(stats.peakLiveBytes, stats.liveBytes);
+    if (scene) {
+        scene->liveBytes += bytes;
+        scene->peakLiveBytes = std::max(scene->peakLiveBytes, scene->liveBytes);
+    }
+    auto it = pool.idle.find(key);
+    if (it == pool.idle.end()) {
+        stats.allocations++;
+        if (scene) scene->allocations++;
+        // Only allocations raise the bytes held, reuses move them from idle to live
+        size_t held         = stats.liveBytes + stats.idleBytes;
+        stats.peakHeldBytes = std::max(stats.peakHeldBytes, held);
+        for (Statistics *open : pool.open)
+            open->peakHeldBytes = std::max(open->peakHeldBytes, held);
+        return Buffer(nullptr, [](void *) {});
+    }
+    Buffer ret = std::move(it->second.image);
+    pool.idle.erase(it);
+    stats.reuses++;
+    if (scene) scene->reuses++;
+    stats.idleBytes -= bytes;
+    return ret;
+}
+
+void Give(
+    std::type_index type,
+    Eigen::Index rows,
+    Eigen::Index cols,
+    size_t bytes,
+    Buffer image,
+    const std::shared_ptr<Statistics> &scene
+) {
+    State &pool = Pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    Statistics &stats = pool.stats;
+    stats.liveBytes -= bytes;
+    if (scene) scene->liveBytes -= bytes;
+    if (!image || stats.idleBytes + bytes > stats.peakLiveBytes) return;
+    stats.idleBytes += bytes;
+    pool.idle.emplace(Key(type, rows, cols), Idle{bytes, std::move(image)});
+}
+
+Statistics Stats() {
+    State &pool = Pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return pool.stats;
+}
+
+std::string Report(const Statistics &stats) {
+    const size_t MiB = size_t(1) << 20;
+    std::stringstream buffer;
+    buffer << stats.allocations << " images allocated, " << stats.reuses << " reused, peak "
+           << stats.peakLiveBytes / MiB << " MiB live and " << stats.peakHeldBytes / MiB
+           << " MiB held, " << stats.idleBytes / MiB << " MiB idle";
+    return buffer.str();
+}
+
+Scene::Scene()
+    : tally(std::make_shared<Statistics>())
+    , enclosing(Current) {
+    Current     = tally;
+    State &pool = Pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    tally->peakHeldBytes = pool.stats.liveBytes + pool.stats.idleBytes;
+    pool.open.push_back(tally.get());
+}
+
+Scene::~Scene() {
+    Current     = enclosing;
+    State &pool = Pool();
+    std::multimap<Key, Idle> unused;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.open.erase(std::find(pool.open.begin(), pool.open.end(), tally.get()));
+        if (!pool.open.empty()) return;
+        // Freed outside the lock
+        for (auto it = pool.idle.begin(); it != pool.idle.end();) {
+            if (pool.requested.count(it->first)) {
+                it++;
+                continue;
+            }
+            pool.stats.idleBytes -= it->second.bytes;
+            unused.insert(pool.idle.extract(it++));
+        }
+        pool.requested.clear();
+    }
+}
+
+Statistics Scene::Stats() const {
+    State &pool = Pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    Statistics ret = *tally;
+    ret.idleBytes  = pool.stats.idleBytes;
+    return ret;
+}
+}  // namespace ImagePool
@@ -0,0 +1,76 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+
+#include "types.h"
+
+namespace ImagePool {
+struct Statistics {
+    size_t allocations   = 0u;  // Images taken from the heap
+    size_t reuses        = 0u;  // Images handed out again from the pool
+    size_t liveBytes     = 0u;  // Held by images in use
+    size_t idleBytes     = 0u;  // Held by the pool for reuse
+    size_t peakLiveBytes = 0u;
+    size_t peakHeldBytes = 0u;  // Most live and idle bytes at once
+};
+// Over the life of the process
+Statistics Stats();
+std::string Report(const Statistics &stats);
+
+// Counts the images made on the thread that opened it until it closes, images are still shared
+// with every other scene so one freed here serves the next request of its shape anywhere. Once
+// the last open scene closes, idle images of shapes no scene asked for since the pool was last
+// idle are freed, the ones a following scene of the same shape will ask for are kept
+struct Scene {
+    Scene();
+    ~Scene();
+    Scene(const Scene &)            = delete;
+    Scene &operator=(const Scene &) = delete;
+    // Allocations, reuses and live bytes are the scene's own, idle and held bytes the pool's
+    // while the scene was open
+    Statistics Stats() const;
+    std::shared_ptr<Statistics> tally;
+    std::shared_ptr<Statistics> enclosing;  // The scene open on this thread before, if any
+};
+// The tally of the scene open on this thread, empty when there is none
+std::shared_ptr<Statistics> CurrentScene();
+
+// An idle image while the pool holds it, the deleter knows its type
+using Buffer = std::unique_ptr<void, void (*)(void *)>;
+// An idle image of the type and shape, empty when there is none and one must be allocated
+Buffer Take(
+    std::type_index type,
+    Eigen::Index rows,
+    Eigen::Index cols,
+    size_t bytes,
+    const std::shared_ptr<Statistics> &scene
+);
+// Returns an image taken with Take, kept while the idle images fit in the peak working set and
+// freed otherwise, an empty buffer only ends its use
+void Give(
+    std::type_index type,
+    Eigen::Index rows,
+    Eigen::Index cols,
+    size_t bytes,
+    Buffer image,
+    const std::shared_ptr<Statistics> &scene
+);
+
+// Uninitialized like make_shared<Image<T>>(rows, cols), but the image goes back to the pool for
+// the next request of its shape once its last owner lets go
+template<class T>
+std::shared_ptr<Image<T>> Make(Eigen::Index rows, Eigen::Index cols) {
+    size_t bytes                      = size_t(rows) * size_t(cols) * sizeof(T);
+    std::shared_ptr<Statistics> scene = CurrentScene();
+    Buffer idle                       = Take(typeid(T), rows, cols, bytes, scene);
+    Image<T> *image = idle ? static_cast<Image<T> *>(idle.release()) : new Image<T>(rows, cols);
+    return std::shared_ptr<Image<T>>(image, [rows, cols, bytes, scene](Image<T> *image) {
+        Buffer buffer(image, [](void *p) { delete static_cast<Image<T> *>(p); });
+        // Resized by an owner, it no longer fits requests of the shape it was made for
+        if (image->rows() != rows || image->cols() != cols) buffer.reset();
+        Give(typeid(T), rows, cols, bytes, std::move(buffer), scene);
+    });
+}
+}  // namespace ImagePool
@@ -0,0 +1,56 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Parallel {
+inline unsigned int Concurrency() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+// Splits [begin, end) into one contiguous range per worker and calls f(worker, begin, end) on each,
+// returns once every range is done
+template<class F>
+void ForRanges(size_t begin, size_t end, F f) {
+    size_t count         = end > begin ? end - begin : 0;
+    unsigned int workers = unsigned(std::min<size_t>(Concurrency(), count));
+    if (workers <= 1u) {
+        f(0u, begin, end);
+        return;
+    }
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (unsigned int w = 0u; w < workers; w++)
+        threads.emplace_back(f, w, begin + count * w / workers, begin + count * (w + 1) / workers);
+    for (auto &thread : threads)
+        thread.join();
+}
+
+// Calls f(worker, i) for every i in [begin, end), each worker taking the next index once it is
+// done, for items of uneven cost
+template<class F>
+void ForEach(size_t begin, size_t end, F f) {
+    std::atomic<size_t> next = begin;
+    size_t count             = end > begin ? end - begin : 0;
+    ForRanges(0, std::min<size_t>(Concurrency(), count), [&](unsigned int worker, size_t, size_t) {
+        for (size_t i = next++; i < end; i = next++)
+            f(worker, i);
+    });
+}
+
+// Cuts [begin, end) into fixed size chunks, maps each on any worker and combines the results
+// pairwise in chunk order, so the result is the same for any number of workers
+template<class T, class Map, class Combine>
+T Reduce(size_t begin, size_t end, size_t chunk, T identity, Map map, Combine combine) {
+    size_t chunks = end > begin ? (end - begin + chunk - 1) / chunk : 0;
+    if (chunks == 0) return identity;
+    std::vector<T> partial(chunks, identity);
+    ForRanges(0, chunks, [&](unsigned int, size_t first, size_t last) {
+        for (size_t c = first; c < last; c++)
+            partial[c] = map(begin + c * chunk, std::min(end, begin + (c + 1) * chunk));
+    });
+    for (size_t width = 1; width < chunks; width *= 2)
+        for (size_t c = 0; c + width < chunks; c += 2 * width)
+            partial[c] = combine(partial[c], partial[c + width]);
+    return partial[0];
+}
+}  // namespace Parallel
@@ -6,9 +6,11 @@
 
 #include "ComputeEnvironment.h"
 #include "Functions.h"
+#include "ImagePool.h"
 #include "boilerplate/Log.h"
 
 #define _USE_MATH_DEFINES
+#include <chrono>
 #include <vector>
 
 #include <math.h>
@@ -18,12 +20,6 @@ using namespace ComputeEnvironment;
 using namespace Functions;
 
 namespace PitFillAlgorithm {
-program Program;
-kernel Kernel;
-vector<float> image1;
-vector<float> original;
-vector<int> hasChanged;
-vector<float> image2;
 
 const char cl_kernal_code[] = BOOST_COMPUTE_STRINGIZE_SOURCE(
 
@@ -89,30 +85,32 @@ const char cl_kernal_code[] = BOOST_COMPUTE_STRINGIZE_SOURCE(
 
 );
 
-void init() {
+PitFillContext::PitFillContext(command_queue queue)
+    : queue(queue) {
     try {
-        Program = program::create_with_source(cl_kernal_code, Context);
-        Program.build();
-        Kernel     = kernel(Program, "PitFill");
-        image1     = vector<float>(1, Context);
-        original   = vector<float>(1, Context);
-        hasChanged = vector<int>(1, Context);
-        image2     = vector<float>(1, Context);
+        Kernel     = kernel(SharedProgram(cl_kernal_code), "PitFill");
+        image1     = vector<float>(1, queue.get_context());
+        original   = vector<float>(1, queue.get_context());
+        hasChanged = vector<int>(1, queue.get_context());
+        image2     = vector<float>(1, queue.get_context());
     } catch (opencl_error error) {
         Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
     }
 }
 
 std::shared_ptr<ImageFloat>
-PitFillAlgorithmFilter(std::shared_ptr<ImageFloat> in, float borderValue) {
+PitFillAlgorithmFilter(
+    PitFillContext &context, std::shared_ptr<ImageFloat> in, float borderValue
+) {
+    auto start = std::chrono::steady_clock::now();
     std::vector<float> initv(in->size(), 1.f);
-    if (image1.size() != in->size()) {
-        image1   = vector<float>(in->size(), Context);
-        original = vector<float>(in->size(), Context);
-        image2   = vector<float>(in->size(), Context);
+    if (context.image1.size() != in->size()) {
+        context.image1   = vector<float>(in->size(), context.queue.get_context());
+        context.original = vector<float>(in->size(), context.queue.get_context());
+        context.image2   = vector<float>(in->size(), context.queue.get_context());
     }
-    copy(in->data(), in->data() + in->size(), original.begin(), CommandQueue);
-    copy(initv.data(), initv.data() + initv.size(), image1.begin(), CommandQueue);
+    copy(in->data(), in->data() + in->size(), context.original.begin(), context.queue);
+    copy(initv.data(), initv.data() + initv.size(), context.image1.begin(), context.queue);
 
     // Define our compute sizes
     // Define our compute sizes
@@ -120,39 +118,56 @@ PitFillAlgorithmFilter(std::shared_ptr<ImageFloat> in, float borderValue) {
         = {ceilingMultiple<size_t>(in->cols(), 8), ceilingMultiple<size_t>(in->rows(), 8)};
     const size_t local_work_size[2] = {8, 8};
 
-    vector<float> *source = &image2;
-    vector<float> *destin = &image1;
+    vector<float> *source = &context.image2;
+    vector<float> *destin = &context.image1;
 
     std::vector<int> hasChanged_host = {0};
 
     // int count = 0;
     do {
         hasChanged_host[0] = 0;
-        copy(hasChanged_host.begin(), hasChanged_host.end(), hasChanged.begin(), CommandQueue);
+        copy(
+            hasChanged_host.begin(),
+            hasChanged_host.end(),
+            context.hasChanged.begin(),
+            context.queue
+        );
         // std::swap(source, destin);
         vector<float> *temp = destin;
         destin              = source;
         source              = temp;
         try {
-            Kernel.set_arg(0, source->get_buffer());
-            Kernel.set_arg(1, int(in->cols()));
-            Kernel.set_arg(2, int(in->rows()));
-            Kernel.set_arg(3, original.get_buffer());
-            Kernel.set_arg(4, borderValue);
-            Kernel.set_arg(5, hasChanged.get_buffer());
-            Kernel.set_arg(6, destin->get_buffer());
-            CommandQueue.enqueue_nd_range_kernel(Kernel, 2, 0, global_work_size, local_work_size);
-            CommandQueue.finish();
+            context.Kernel.set_arg(0, source->get_buffer());
+            context.Kernel.set_arg(1, int(in->cols()));
+            context.Kernel.set_arg(2, int(in->rows()));
+            context.Kernel.set_arg(3, context.original.get_buffer());
+            context.Kernel.set_arg(4, borderValue);
+            context.Kernel.set_arg(5, context.hasChanged.get_buffer());
+            context.Kernel.set_arg(6, destin->get_buffer());
+            context.queue.enqueue_nd_range_kernel(
+                context.Kernel, 2, 0, global_work_size, local_work_size
+            );
+            context.queue.finish();
         } catch (opencl_error error) {
             Log::error("OpenCL Error: {} returned {}", error.what(), error.error_string());
         }
-        copy(hasChanged.begin(), hasChanged.end(), hasChanged_host.begin(), CommandQueue);
+        copy(
+            context.hasChanged.begin(),
+            context.hasChanged.end(),
+            hasChanged_host.begin(),
+            context.queue
+        );
         // std::cout << ++count << std::endl;
     } while (hasChanged_host[0]);
 
     // Return Value
-    std::shared_ptr<ImageFloat> ret = std::make_shared<ImageFloat>(in->rows(), in->cols());
-    copy(destin->begin(), destin->end(), ret->data(), CommandQueue);
+    std::shared_ptr<ImageFloat> ret = ImagePool::Make<float>(in->rows(), in->cols());
+    copy(destin->begin(), destin->end(), ret->data(), context.queue);
+    RecordWork(
+        context.queue,
+        size_t(in->size()),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+    );
     return ret;
 }
 }  // namespace PitFillAlgorithm
\ No newline at end of file
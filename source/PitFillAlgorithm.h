@@ -1,10 +1,22 @@
 #pragma once
 #include <memory>
 
+#include <boost/compute/container/vector.hpp>
+#include <boost/compute/core.hpp>
+
 #include "types.h"
 
 namespace PitFillAlgorithm {
-void init();
+// Kernel and scratch buffers bound to one queue, only one thread may use a context at a time
+struct PitFillContext {
+    explicit PitFillContext(boost::compute::command_queue queue);
+    boost::compute::command_queue queue;
+    boost::compute::kernel Kernel;
+    boost::compute::vector<float> image1;
+    boost::compute::vector<float> original;
+    boost::compute::vector<int> hasChanged;
+    boost::compute::vector<float> image2;
+};
 std::shared_ptr<ImageFloat>
-PitFillAlgorithmFilter(std::shared_ptr<ImageFloat> in, float borderValue);
+PitFillAlgorithmFilter(PitFillContext &context, std::shared_ptr<ImageFloat> in, float borderValue);
 };  // namespace PitFillAlgorithm
@@ -3,7 +3,10 @@
 #include "Functions.h"
 #include "GaussianBlur.h"
 #include "ImageOperations.h"
+#include "ImagePool.h"
+#include "Parallel.h"
 #include "PitFillAlgorithm.h"
+#include "ProbabilityRefinement.h"
 #include "SceneClassificationLayer.h"
 
 using namespace ImageOperations;
@@ -16,23 +19,39 @@ PotentialShadowMask::PotentialShadowMaskGenerationReturn
 PotentialShadowMask::GeneratePotentialShadowMask(
     std::shared_ptr<ImageFloat> NIR,
     std::shared_ptr<ImageBool> CloudMask,
-    std::shared_ptr<ImageUint> SCL
+    std::shared_ptr<ImageUint> SCL,
+    ComputeEnvironment::SceneContext &compute
 ) {
     std::shared_ptr<ImageBool> SCL_SHADOW_DARK
         = GenerateMask(SCL, CLOUD_SHADOWS_MASK | DARK_AREA_PIXELS_MASK);
-    std::shared_ptr<ImageBool> SCL_SHADOW_DARK_WATER
-        = GenerateMask(SCL, CLOUD_SHADOWS_MASK | DARK_AREA_PIXELS_MASK | WATER_MASK);
-    std::vector<float> ClearSky_NIR_Values
-        = partitionUnobscuredObscured(NIR, OR(CloudMask, SCL_SHADOW_DARK_WATER))->first;
+    std::shared_ptr<ImageBool> Obscured = evaluate(OR(
+        lazy(CloudMask),
+        GenerateMask(lazy(SCL), CLOUD_SHADOWS_MASK | DARK_AREA_PIXELS_MASK | WATER_MASK)
+    ));
+    std::vector<float> ClearSky_NIR_Values = partitionUnobscuredObscured(NIR, Obscured)->first;
     float CloudCover_percent   = CoverPercentage(CloudMask);
     float ClearSky_NIR_percent = linearStep(CloudCover_percent, {.07f, .2f}, {.4f, .7f});
     float Outside_value        = percentile(ClearSky_NIR_Values, ClearSky_NIR_percent);
-    std::shared_ptr<ImageFloat> NIR_pitfilled     = PitFillAlgorithmFilter(NIR, Outside_value);
-    std::shared_ptr<ImageFloat> NIR_difference    = SUBTRACT(NIR_pitfilled, NIR);
-    std::shared_ptr<ImageBool> NIR_prelim_mask    = Threshold(NIR_difference, .12f);
-    std::shared_ptr<ImageBool> Result_prelim_mask = Threshold(
-        GaussianBlurFilter(cast<float, bool>(OR(NIR_prelim_mask, SCL_SHADOW_DARK)), 1.f), 0.1f
-    );
-    std::shared_ptr<ImageBool> Result_mask = AND(NOT(CloudMask), Result_prelim_mask);
-    return {Result_mask, NIR_difference};
+    std::shared_ptr<ImageFloat> NIR_pitfilled
+        = PitFillAlgorithmFilter(compute.pitFill, NIR, Outside_value);
+    // Difference, preliminary mask and shadow value in a single traversal of NIR
+    ProbabilityRefinement::AlphaFunction alpha;
+    Eigen::Index rows = NIR->rows(), cols = NIR->cols();
+    std::shared_ptr<ImageFloat> NIR_difference  = ImagePool::Make<float>(rows, cols);
+    std::shared_ptr<ImageFloat> NIR_prelim_mask = ImagePool::Make<float>(rows, cols);
+    std::shared_ptr<ImageFloat> Alpha           = ImagePool::Make<float>(rows, cols);
+    Parallel::ForRanges(0, size_t(NIR->size()), [&](unsigned int, size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++) {
+            float difference           = NIR_pitfilled->data()[p] - NIR->data()[p];
+            bool prelim                = difference >= .12f || SCL_SHADOW_DARK->data()[p];
+            NIR_difference->data()[p]  = difference;
+            NIR_prelim_mask->data()[p] = prelim ? 1.f : 0.f;
+            Alpha->data()[p]           = alpha(difference);
+        }
+    });
+    std::shared_ptr<ImageFloat> NIR_prelim_blurred
+        = GaussianBlurFilter(compute.gaussianBlur, NIR_prelim_mask, 1.f);
+    std::shared_ptr<ImageBool> Result_mask
+        = evaluate(AND(NOT(lazy(CloudMask)), Threshold(lazy(NIR_prelim_blurred), 0.1f)));
+    return {Result_mask, NIR_difference, Alpha};
 }
\ No newline at end of file
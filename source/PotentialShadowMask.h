@@ -1,16 +1,19 @@
 #pragma once
 #include <memory>
 
+#include "ComputeContext.h"
 #include "types.h"
 
 namespace PotentialShadowMask {
 struct PotentialShadowMaskGenerationReturn {
     std::shared_ptr<ImageBool> mask;
     std::shared_ptr<ImageFloat> difference_of_pitfill_NIR;
+    std::shared_ptr<ImageFloat> alpha;  // ProbabilityRefinement::AlphaMap of the difference
 };
 PotentialShadowMaskGenerationReturn GeneratePotentialShadowMask(
     std::shared_ptr<ImageFloat> NIR,
     std::shared_ptr<ImageBool> CloudMask,
-    std::shared_ptr<ImageUint> SCL
+    std::shared_ptr<ImageUint> SCL,
+    ComputeEnvironment::SceneContext &compute
 );
 }  // namespace PotentialShadowMask
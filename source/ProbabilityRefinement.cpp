@@ -1,36 +1,45 @@
 #include "ProbabilityRefinement.h"
 #define _USE_MATH_DEFINES
 #include <math.h>
-#include <list>
 #include <map>
+#include <mutex>
 
 #include "Functions.h"
 #include "ImageOperations.h"
+#include "ImagePool.h"
+#include "Parallel.h"
 
 namespace ImOp = ImageOperations;
 using namespace Functions;
 
-float __f__(float x, float a, float b) { return 1.0 / (1.0 + b * exp(-a * x)); }
+double __f__(double x, double a, double b) { return 1.0 / (1.0 + b * exp(-a * x)); }
+
+float ProbabilityRefinement::AlphaFunction::exact(float NIR_difference) {
+    double a = 17.0, b = .007;
+    return float(__f__(NIR_difference - .5, a, b) - __f__(-.5, a, b));
+}
+
+ProbabilityRefinement::AlphaFunction::AlphaFunction() : m_samples(Samples) {
+    for (int i = 0; i < Samples; i++)
+        m_samples[i] = exact(Min + float(i) / Scale);
+}
 
 std::shared_ptr<ImageFloat> ProbabilityRefinement::AlphaMap(
     std::shared_ptr<ImageFloat> NIR_difference
 ) {
-    // Setup
-    float a = 17.f, b = .007f;
-#define f(x) __f__(x, a, b)
-    float sub   = f(-.5f);
-    float denom = 1.f;
-#define F(x) (f(x - .5f) - sub) * denom;
+    AlphaFunction alpha;
     std::shared_ptr<ImageFloat> ret
-        = std::make_shared<ImageFloat>(NIR_difference->rows(), NIR_difference->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i] = F(NIR_difference->data()[i]);
+        = ImagePool::Make<float>(NIR_difference->rows(), NIR_difference->cols());
+    Parallel::ForRanges(0, size_t(ret->size()), [&](unsigned int, size_t begin, size_t end) {
+        for (size_t p = begin; p < end; p++)
+            ret->data()[p] = alpha(NIR_difference->data()[p]);
+    });
     return ret;
 }
 
 std::shared_ptr<ImageFloat> ProbabilityRefinement::BetaMap(
-    ShadowQuads shadows,
-    std::map<int, CloudShadowMatching::OptimalSolution> solutions,
+    const ShadowQuads &shadows,
+    const std::vector<CloudShadowMatching::OptimalSolution> &solutions,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> shadowMask,
     std::shared_ptr<ImageFloat> CLP,
@@ -42,46 +51,75 @@ std::shared_ptr<ImageFloat> ProbabilityRefinement::BetaMap(
     static const float min_factor             = .15f;
     static const float area_correction_factor = 2.f * M_2_SQRTPI;
 
-    std::shared_ptr<ImageBool> map  = std::make_shared<ImageBool>(CLP->rows(), CLP->cols());
-    std::shared_ptr<ImageFloat> ret = std::make_shared<ImageFloat>(CLP->rows(), CLP->cols());
+    std::shared_ptr<ImageFloat> ret = ImagePool::Make<float>(CLP->rows(), CLP->cols());
     ret->fill(0.f);
 
-    for (auto &s : shadows) {
-        glm::mat4 M_inverse = glm::inverse(solutions[s.first].M);
+    // Shadow pixels map back to their cloud's pixels through the inverse of the solution
+    std::vector<ImOp::AffinePixelMap> maps;
+    for (size_t k = 0; k < shadows.size(); k++)
+        maps.push_back(
+            ImOp::affinePixelMap(shadowMask, CLP, DiagonalLength, glm::inverse(solutions[k].M))
+        );
+
+    // Each worker keeps its buffers cropped to the influence bounds of the current shadow and
+    // merges them into ret by max, so the cost follows the shadow areas instead of the scene's
+    struct Buffers {
+        std::vector<uint8_t> map;
+        std::vector<float> beta;
+        std::vector<float> CLP;  // Cloud probability under the current column
+    };
+    std::vector<Buffers> buffers(Parallel::Concurrency());
+    std::mutex merge;
+    Parallel::ForEach(0, shadows.size(), [&](unsigned int worker, size_t k) {
+        std::span<const PixelRun> runs = shadows.list(k);
+        const ImageBounds &bounds      = shadows.bounds[k];
+        const ImOp::AffinePixelMap &M  = maps[k];
+        std::vector<uint8_t> &map      = buffers[worker].map;
+        std::vector<float> &beta       = buffers[worker].beta;
+        std::vector<float> &column     = buffers[worker].CLP;
         // Apply distance to factor function and generate function area
         float influence_distance_f = std::clamp(
-            area_correction_factor * sqrtf(float(s.second.pixels.list.size())),
-            min_distance,
-            max_distance
+            area_correction_factor * sqrtf(float(shadows.area(k))), min_distance, max_distance
         );
         int influence_distance_i = int(floorf(influence_distance_f));
         ImageBounds influence_bounds
             = {{(unsigned int)(std::clamp(
-                    int(s.second.pixels.bounds.p0.x) - influence_distance_i, 0, int(CLP->cols()) - 1
+                    int(bounds.p0.x) - influence_distance_i, 0, int(CLP->cols()) - 1
                 )),
                 (unsigned int)(std::clamp(
-                    int(s.second.pixels.bounds.p0.y) - influence_distance_i, 0, int(CLP->rows()) - 1
+                    int(bounds.p0.y) - influence_distance_i, 0, int(CLP->rows()) - 1
                 ))},
                {(unsigned int)(std::clamp(
-                    int(s.second.pixels.bounds.p1.x) + influence_distance_i, 0, int(CLP->cols()) - 1
+                    int(bounds.p1.x) + influence_distance_i, 0, int(CLP->cols()) - 1
                 )),
                 (unsigned int)(std::clamp(
-                    int(s.second.pixels.bounds.p1.y) + influence_distance_i, 0, int(CLP->rows()) - 1
+                    int(bounds.p1.y) + influence_distance_i, 0, int(CLP->rows()) - 1
                 ))}};
+        glm::uvec2 origin  = influence_bounds.p0;
+        unsigned int width = influence_bounds.p1.x - origin.x + 1;
+        auto local         = [&](unsigned int i, unsigned int j) {
+            return (i - origin.x) + width * (j - origin.y);
+        };
         // We onluy need to check borders for distance
-        Shadow shadow_border = border(s.second.pixels);
+        std::vector<glm::uvec2> shadow_border = border(bounds, runs);
         // Reset map for shadow;
-        map->fill(false);
-        for (auto &pix : s.second.pixels.list)
-            ImOp::set(map, pix.x, pix.y, true);
+        map.assign(width * (influence_bounds.p1.y - origin.y + 1), 0u);
+        beta.assign(map.size(), 0.f);
+        for (auto &run : runs)
+            std::fill_n(map.begin() + local(run.i0, run.j), run.size(), 1u);
         // For each pixel in bounds
+        column.resize(influence_bounds.p1.y - origin.y + 1);
         for (unsigned int i = influence_bounds.p0.x; i <= influence_bounds.p1.x; i++) {
+            // Corresponding cloud probabilities of the whole column, negative off the image
+            ImOp::sampleColumn(
+                CLP, M, i, influence_bounds.p0.y, influence_bounds.p1.y + 1, -1.f, column.data()
+            );
             for (unsigned int j = influence_bounds.p0.y; j <= influence_bounds.p1.y; j++) {
                 // Set as max distance
                 float current_distance = max<float>();
                 // Not a shadow pixel
-                if (!ImOp::at(map, i, j))
-                    for (auto &p : shadow_border.list)  // Find Closest Pixel
+                if (!map[local(i, j)])
+                    for (auto &p : shadow_border)  // Find Closest Pixel
                         current_distance = glm::min(current_distance, pixelDistance(p, {i, j}));
                 else current_distance = 0.f;  // No distance since it is a shadow Pixel
                 // If the closest pixel is close enough
@@ -93,24 +131,18 @@ std::shared_ptr<ImageFloat> ProbabilityRefinement::BetaMap(
                         influence_distance_f,
                         mid_percentile
                     );
-                    // Find the corresponding cloud pixel
-                    glm::ivec2 cloud_space_index = ImOp::index(
-                        cloudMask,
-                        DiagonalLength,
-                        glm::vec2(
-                            M_inverse * glm::vec4(ImOp::pos(shadowMask, DiagonalLength, i, j), 1.f)
-                        )
-                    );
+                    float CLP_v = column[j - origin.y];
                     // If there exists a valid cloud pixel
-                    if (ImOp::valid(CLP, cloud_space_index.x, cloud_space_index.y)) {
-                        // Obtain the
-                        float CLP_v = ImOp::at(CLP, cloud_space_index.x, cloud_space_index.y);
-                        ImOp::set(ret, i, j, std::max(CLP_v * factor, ImOp::at(ret, i, j)));
-                    }
+                    if (CLP_v >= 0.f)
+                        beta[local(i, j)] = std::max(CLP_v * factor, beta[local(i, j)]);
                 }
             }
         }
-    }
+        std::lock_guard<std::mutex> lock(merge);
+        for (unsigned int i = influence_bounds.p0.x; i <= influence_bounds.p1.x; i++)
+            for (unsigned int j = influence_bounds.p0.y; j <= influence_bounds.p1.y; j++)
+                ImOp::set(*ret, i, j, std::max(beta[local(i, j)], ImOp::at(*ret, i, j)));
+    });
     return ret;
 }
 
@@ -127,8 +159,8 @@ ProbabilityRefinement::UniformProbabilitySurface __Sample_Surface__(
     for (int i = 0; i < alphaMap->size(); i++) {
         int cellx = std::min(int(floorf(alphaMap->data()[i] * float(div))), int(div) - 1);
         int celly = std::min(int(floorf(betaMap->data()[i] * float(div))), int(div) - 1);
-        ImOp::set(total, cellx, celly, ImOp::at(total, cellx, celly) + 1u);
-        if (mask->data()[i]) ImOp::set(shadow, cellx, celly, ImOp::at(shadow, cellx, celly) + 1u);
+        ImOp::set(*total, cellx, celly, ImOp::at(*total, cellx, celly) + 1u);
+        if (mask->data()[i]) ImOp::set(*shadow, cellx, celly, ImOp::at(*shadow, cellx, celly) + 1u);
     }
 
     auto result = ImOp::DIVIDE(ImOp::cast<float>(shadow), ImOp::cast<float>(total));
@@ -136,56 +168,77 @@ ProbabilityRefinement::UniformProbabilitySurface __Sample_Surface__(
     ProbabilityRefinement::UniformProbabilitySurface ret({div, div});
     for (int i = 0; i < div; i++) {
         for (int j = 0; j < div; j++) {
-            if (ImOp::at(total, i, j) > 0u) ret.set(i, j, ImOp::at(result, i, j));
+            if (ImOp::at(*total, i, j) > 0u) ret.set(i, j, ImOp::at(*result, i, j));
         }
     }
 }
 
-ProbabilityRefinement::UniformProbabilitySurface
-__ProbabilityMap__Element(std::vector<glm::vec3> &samples, unsigned int D) {
-    std::vector<std::pair<glm::vec3, unsigned int>> collections(D * D);
-    for (auto &s : samples) {
-        int i                         = std::max(std::min(int(floorf(s.x * D)), int(D) - 1), 0);
-        int j                         = std::max(std::min(int(floorf(s.y * D)), int(D) - 1), 0);
-        collections[i + D * j].first  = collections[i + D * j].first + s;
-        collections[i + D * j].second = collections[i + D * j].second + 1;
+// Sample count and shadow count of each (alpha, beta) cell, indexed i + D * j
+struct __Histogram__ {
+    unsigned int D;
+    std::vector<unsigned int> count;
+    std::vector<unsigned int> shadow;
+    __Histogram__(unsigned int D) : D(D), count(D * D, 0u), shadow(D * D, 0u) {}
+};
+
+// Bins every pixel once at resolution D, each worker into its own histogram
+__Histogram__ __Bin__(
+    std::shared_ptr<ImageBool> shadowMask,
+    std::shared_ptr<ImageFloat> alphaMap,
+    std::shared_ptr<ImageFloat> betaMap,
+    unsigned int D
+) {
+    std::vector<__Histogram__> partial(Parallel::Concurrency(), __Histogram__(D));
+    Parallel::ForRanges(0, size_t(shadowMask->size()), [&](unsigned int w, size_t b, size_t e) {
+        __Histogram__ &h   = partial[w];
+        const bool *mask   = shadowMask->data();
+        const float *alpha = alphaMap->data();
+        const float *beta  = betaMap->data();
+        for (size_t p = b; p < e; p++) {
+            int i = std::max(std::min(int(floorf(alpha[p] * D)), int(D) - 1), 0);
+            int j = std::max(std::min(int(floorf(beta[p] * D)), int(D) - 1), 0);
+            h.count[i + D * j]++;
+            if (mask[p]) h.shadow[i + D * j]++;
+        }
+    });
+    __Histogram__ ret(D);
+    for (auto &h : partial)
+        for (unsigned int c = 0; c < D * D; c++) {
+            ret.count[c] += h.count[c];
+            ret.shadow[c] += h.shadow[c];
+        }
+    return ret;
+}
+
+// Halves the resolution, floor(x * D / 2) is floor(x * D) / 2 so each cell sums a 2x2 block
+__Histogram__ __Coarsen__(const __Histogram__ &h) {
+    __Histogram__ ret(h.D / 2);
+    for (unsigned int j = 0; j < h.D; j++)
+        for (unsigned int i = 0; i < h.D; i++) {
+            ret.count[i / 2 + ret.D * (j / 2)] += h.count[i + h.D * j];
+            ret.shadow[i / 2 + ret.D * (j / 2)] += h.shadow[i + h.D * j];
+        }
+    return ret;
+}
+
+ProbabilityRefinement::UniformProbabilitySurface __ProbabilityMap__Element(const __Histogram__ &h) {
+    unsigned int D                   = h.D;
+    std::shared_ptr<ImageFloat> mean = std::make_shared<ImageFloat>(D, D);
+    std::shared_ptr<ImageBool> valid = std::make_shared<ImageBool>(D, D);
+    for (int i = 0; i < D; i++) {
+        for (int j = 0; j < D; j++) {
+            unsigned int count = h.count[i + D * j];
+            ImOp::set(*mean, i, j, count > 0 ? float(h.shadow[i + D * j]) / float(count) : 0.f);
+            ImOp::set(*valid, i, j, count > 0);
+        }
     }
+    // Empty cells take the inverse square distance weighted mean of their filled neighbours
+    std::shared_ptr<ImageFloat> filled = ImOp::fillHoles(mean, valid);
 
     ProbabilityRefinement::UniformProbabilitySurface ret({D, D});
-#define VALUE(i, j) collections[i + D * j].first
-#define COUNT(i, j) collections[i + D * j].second
-#define VALID(i, j) COUNT(i, j) > 0
-    std::list<glm::ivec2> empty_pixels;
     for (int i = 0; i < D; i++)
         for (int j = 0; j < D; j++)
-            if (VALID(i, j)) ret.set(i, j, (VALUE(i, j) / float(COUNT(i, j))).z);
-            else empty_pixels.push_back({i, j});
-
-#define VALID_N(i, j) (i < 0 || i >= D || j < 0 || j >= D) ? false : VALID(i, j)
-#define VALUE_N(i, j) (i < 0 || i >= D || j < 0 || j >= D) ? 0.f : ret.at(i, j)
-    while (!empty_pixels.empty()) {
-        for (auto it = empty_pixels.begin(); it != empty_pixels.end(); it++) {
-            auto &v           = *it;
-            float accum       = 0.f;
-            float totalWeight = 0.f;
-            bool calc         = false;
-            for (int i = -1; i <= 1; i++) {
-                for (int j = -1; j <= 1; j++) {
-                    if (VALID_N(v.x + i, v.y + j)) {
-                        calc = true;
-                        accum += ret.at(v.x + i, v.y + j) / float(i * i + j * j);
-                        totalWeight += 1.f / float(i * i + j * j);
-                    }
-                }
-            }
-            if (calc) {
-                COUNT(v.x, v.y) = 1;
-                ret.set(v.x, v.y, accum / totalWeight);
-                empty_pixels.erase(it--);
-            }
-        }
-    }
-
+            ret.set(i, j, ImOp::at(*filled, i, j));
     return ret;
 }
 
@@ -197,16 +250,13 @@ ProbabilityRefinement::UniformProbabilitySurface ProbabilityRefinement::Probabil
     static const unsigned int D[] = {8u, 16u, 32u, 64u, 128u};
     static const float W[]        = {16.f / 31.f, 8.f / 31.f, 4.f / 31.f, 2.f / 31.f, 1.f / 31.f};
 
-    std::vector<glm::vec3> samples;
-    for (int i = 0; i < shadowMask->size(); i++)
-        samples.push_back(
-            {alphaMap->data()[i], betaMap->data()[i], shadowMask->data()[i] ? 1.f : 0.f}
-        );
-
+    // A single pass at the finest resolution, the coarser levels are summed from it
     UniformProbabilitySurface elements[5];
-
-    for (int i = 0; i < 5; i++)
-        elements[i] = __ProbabilityMap__Element(samples, D[i]);
+    __Histogram__ histogram = __Bin__(shadowMask, alphaMap, betaMap, D[4]);
+    for (int i = 4; i >= 0; i--) {
+        elements[i] = __ProbabilityMap__Element(histogram);
+        if (i > 0) histogram = __Coarsen__(histogram);
+    }
 
     UniformProbabilitySurface ret({256, 256});
     ret.set(Bounds::ALPHA_MIN, 0.f);
@@ -227,6 +277,25 @@ ProbabilityRefinement::UniformProbabilitySurface ProbabilityRefinement::Probabil
     return ret;
 }
 
+// Cells per axis of the decision table over [0, 1) x [0, 1), four per cell of the 256 surface
+static const int DecisionResolution = 1024;
+
+// threshold <= surface(alpha, beta) at the centre of every table cell, row j holding beta
+std::vector<uint8_t> __DecisionTable__(
+    ProbabilityRefinement::UniformProbabilitySurface &probabilitySurface,
+    float threshold
+) {
+    const int Q = DecisionResolution;
+    std::vector<uint8_t> ret(Q * Q);
+    Parallel::ForRanges(0, Q, [&](unsigned int, size_t begin, size_t end) {
+        for (int j = int(begin); j < int(end); j++)
+            for (int i = 0; i < Q; i++)
+                ret[i + Q * j]
+                    = threshold <= probabilitySurface((i + .5f) / float(Q), (j + .5f) / float(Q));
+    });
+    return ret;
+}
+
 std::shared_ptr<ImageBool> ProbabilityRefinement::ImprovedShadowMask(
     std::shared_ptr<ImageBool> shadowMask,
     std::shared_ptr<ImageBool> cloudMask,
@@ -235,14 +304,30 @@ std::shared_ptr<ImageBool> ProbabilityRefinement::ImprovedShadowMask(
     UniformProbabilitySurface probabilitySurface,
     float threshold
 ) {
-    std::shared_ptr<ImageBool> ret
-        = std::make_shared<ImageBool>(shadowMask->rows(), shadowMask->cols());
-    ret->fill(false);
-    for (int i = 0; i < shadowMask->cols(); i++)
-        for (int j = 0; j < shadowMask->rows(); j++)
-            if (threshold <= probabilitySurface(ImOp::at(alphaMap, i, j), ImOp::at(betaMap, i, j)))
-                ImOp::set(ret, i, j, true);
-    return ImOp::AND(ImOp::OR(ret, shadowMask), ImOp::NOT(cloudMask));
+    if (!ImOp::DIM_CHECK(shadowMask, cloudMask) || !ImOp::DIM_CHECK(shadowMask, alphaMap)
+        || !ImOp::DIM_CHECK(shadowMask, betaMap))
+        return nullptr;
+    const float Q                 = float(DecisionResolution);
+    std::vector<uint8_t> decision = __DecisionTable__(probabilitySurface, threshold);
+    std::shared_ptr<ImageBool> ret = ImagePool::Make<bool>(shadowMask->rows(), shadowMask->cols());
+    // Fused with the OR against the shadow mask and the AND against the inverted cloud mask, pixels
+    // outside the table fall back to evaluating the surface
+    Parallel::ForRanges(0, size_t(ret->size()), [&](unsigned int, size_t begin, size_t end) {
+        const float *alpha = alphaMap->data();
+        const float *beta  = betaMap->data();
+        const bool *shadow = shadowMask->data();
+        const bool *cloud  = cloudMask->data();
+        bool *out          = ret->data();
+        for (size_t p = begin; p < end; p++) {
+            float a       = alpha[p];
+            float b       = beta[p];
+            bool improved = (a >= 0.f && a < 1.f && b >= 0.f && b < 1.f)
+                                ? decision[int(a * Q) + DecisionResolution * int(b * Q)]
+                                : threshold <= probabilitySurface(a, b);
+            out[p]        = (improved || shadow[p]) && !cloud[p];
+        }
+    });
+    return ret;
 }
 
 ProbabilityRefinement::UniformProbabilitySurface::UniformProbabilitySurface() {}
@@ -315,39 +400,39 @@ float ProbabilityRefinement::UniformProbabilitySurface::at(int i, int j) {
 
     // Exact element *Normally
     if (middle_x && middle_y) [[likely]]
-        return ImOp::at(m_data, i, j);
+        return ImOp::at(*m_data, i, j);
     //
     // Single Interpolation
     else if (left && middle_y) {  // i < 0
         if (m_alpha_min_clamp.has_value())
-            return linear(m_alpha_min_clamp.value(), ImOp::at(m_data, 0, j), float(2 * i + 1));
-        return linear(ImOp::at(m_data, 0, j), ImOp::at(m_data, 1, j), float(i));
+            return linear(m_alpha_min_clamp.value(), ImOp::at(*m_data, 0, j), float(2 * i + 1));
+        return linear(ImOp::at(*m_data, 0, j), ImOp::at(*m_data, 1, j), float(i));
     } else if (right && middle_y) {  // i >= width
         if (m_alpha_max_clamp.has_value())
             return linear(
-                ImOp::at(m_data, m_data->cols() - 1, j),
+                ImOp::at(*m_data, m_data->cols() - 1, j),
                 m_alpha_max_clamp.value(),
                 float(2 * (i + 1 - m_data->cols()))
             );
         return linear(
-            ImOp::at(m_data, m_data->cols() - 2, j),
-            ImOp::at(m_data, m_data->cols() - 1, j),
+            ImOp::at(*m_data, m_data->cols() - 2, j),
+            ImOp::at(*m_data, m_data->cols() - 1, j),
             float(i + 2 - m_data->cols())
         );
     } else if (middle_x && down) {  // j < 0
         if (m_beta_min_clamp.has_value())
-            return linear(m_beta_min_clamp.value(), ImOp::at(m_data, i, 0), float(2 * j + 1));
-        return linear(ImOp::at(m_data, i, 0), ImOp::at(m_data, i, 1), float(j));
+            return linear(m_beta_min_clamp.value(), ImOp::at(*m_data, i, 0), float(2 * j + 1));
+        return linear(ImOp::at(*m_data, i, 0), ImOp::at(*m_data, i, 1), float(j));
     } else if (middle_x && up) {  // j >= height
         if (m_beta_max_clamp.has_value())
             return linear(
-                ImOp::at(m_data, i, m_data->rows() - 1),
+                ImOp::at(*m_data, i, m_data->rows() - 1),
                 m_beta_max_clamp.value(),
                 float(2 * (j + 1 - m_data->rows()))
             );
         return linear(
-            ImOp::at(m_data, i, m_data->rows() - 2),
-            ImOp::at(m_data, i, m_data->rows() - 1),
+            ImOp::at(*m_data, i, m_data->rows() - 2),
+            ImOp::at(*m_data, i, m_data->rows() - 1),
             float(j + 2 - m_data->rows())
         );
     }
@@ -385,7 +470,7 @@ float ProbabilityRefinement::UniformProbabilitySurface::at(int i, int j) {
 }
 
 void ProbabilityRefinement::UniformProbabilitySurface::set(int i, int j, float v) {
-    ImOp::set(m_data, i, j, v);
+    ImOp::set(*m_data, i, j, v);
 }
 
 void ProbabilityRefinement::UniformProbabilitySurface::set(Bounds axis, float v) {
@@ -5,12 +5,31 @@
 #include "types.h"
 
 namespace ProbabilityRefinement {
+// Shadow value of a pit fill difference, linearly interpolated from samples of the logistic over
+// [-1, 1] and evaluated exactly outside of it
+struct AlphaFunction {
+    AlphaFunction();
+    float operator()(float NIR_difference) const {
+        float x = (NIR_difference - Min) * Scale;
+        if (!(x >= 0.f && x < float(Samples - 1))) return exact(NIR_difference);
+        int i = int(x);
+        return m_samples[i] + (x - float(i)) * (m_samples[i + 1] - m_samples[i]);
+    }
+    static float exact(float NIR_difference);
+
+  private:
+    // The logistic's second derivative stays below 28, so 28 h^2 / 8 plus rounding, about 1e-6
+    static constexpr int Samples = 4096;
+    static constexpr float Min   = -1.f;
+    static constexpr float Scale = float(Samples - 1) / 2.f;
+    std::vector<float> m_samples;
+};
 // Shadow Value Map
 std::shared_ptr<ImageFloat> AlphaMap(std::shared_ptr<ImageFloat> NIR_difference);
 // Shadow Projected Probability Map
 std::shared_ptr<ImageFloat> BetaMap(
-    ShadowQuads shadows,
-    std::map<int, CloudShadowMatching::OptimalSolution> solutions,
+    const ShadowQuads &shadows,
+    const std::vector<CloudShadowMatching::OptimalSolution> &solutions,
     std::shared_ptr<ImageBool> cloudMask,
     std::shared_ptr<ImageBool> shadowMask,
     std::shared_ptr<ImageFloat> CLP,
@@ -1,35 +1,15 @@
 #include "SceneClassificationLayer.h"
 
+#include "ImageOperations.h"
+#include "ImagePool.h"
+
 std::shared_ptr<ImageBool>
 SceneClassificationLayer::GenerateMask(std::shared_ptr<ImageUint> A, unsigned int channelCodes) {
-    std::shared_ptr<ImageBool> ret = std::make_shared<ImageBool>(A->rows(), A->cols());
-    for (int i = 0; i < ret->size(); i++)
-        switch (A->data()[i]) {
-            case NO_DATA_VALUE: ret->data()[i] = (channelCodes & NO_DATA_MASK) > 0; break;
-            case SATURATED_DEFECTIVE_VALUE:
-                ret->data()[i] = (channelCodes & SATURATED_DEFECTIVE_MASK) > 0;
-                break;
-            case DARK_AREA_PIXELS_VALUE:
-                ret->data()[i] = (channelCodes & DARK_AREA_PIXELS_MASK) > 0;
-                break;
-            case CLOUD_SHADOWS_VALUE:
-                ret->data()[i] = (channelCodes & CLOUD_SHADOWS_MASK) > 0;
-                break;
-            case VEGITATION_VALUE: ret->data()[i] = (channelCodes & VEGITATION_MASK) > 0; break;
-            case BARE_SOIL_VALUE: ret->data()[i] = (channelCodes & BARE_SOIL_MASK) > 0; break;
-            case WATER_VALUE: ret->data()[i] = (channelCodes & WATER_MASK) > 0; break;
-            case CLOUD_LOW_VALUE: ret->data()[i] = (channelCodes & CLOUD_LOW_MASK) > 0; break;
-            case CLOUD_MEDIUM_VALUE: ret->data()[i] = (channelCodes & CLOUD_MEDIUM_MASK) > 0; break;
-            case CLOUD_HIGH_VALUE: ret->data()[i] = (channelCodes & CLOUD_HIGH_MASK) > 0; break;
-            case CLOUD_CIRRUS_VALUE: ret->data()[i] = (channelCodes & CLOUD_CIRRUS_MASK) > 0; break;
-            case SNOW_ICE_VALUE: ret->data()[i] = (channelCodes & SNOW_ICE_MASK) > 0; break;
-            default: ret->data()[i] = false; break;
-        }
-    return ret;
+    return ImageOperations::evaluate(GenerateMask(ImageOperations::lazy(A), channelCodes));
 }
 
 std::shared_ptr<ImageUint> SceneClassificationLayer::GenerateRGBA(std::shared_ptr<ImageUint> A) {
-    std::shared_ptr<ImageUint> ret = std::make_shared<ImageUint>(A->rows(), A->cols());
+    std::shared_ptr<ImageUint> ret = ImagePool::Make<unsigned int>(A->rows(), A->cols());
     for (int i = 0; i < ret->size(); i++)
         switch (A->data()[i]) {
             case SATURATED_DEFECTIVE_VALUE: ret->data()[i] = SATURATED_DEFECTIVE_COLOUR; break;
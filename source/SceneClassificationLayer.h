@@ -42,5 +42,12 @@ static const unsigned int CLOUD_CIRRUS_COLOUR        = 0xff00ffff;  // YELLOW
 static const unsigned int SNOW_ICE_COLOUR            = 0xffffff00;  // LIGHT BLUE
 
 std::shared_ptr<ImageBool> GenerateMask(std::shared_ptr<ImageUint> A, unsigned int channelCode);
+// Lazy form for the ImageOperations expressions, true where the class of A is in channelCodes
+template<class E>
+auto GenerateMask(const Eigen::ArrayBase<E> &A, unsigned int channelCodes) {
+    return A.derived().unaryExpr([channelCodes](unsigned int v) {
+        return v <= SNOW_ICE_VALUE && (channelCodes & (1u << v)) > 0;
+    });
+}
 std::shared_ptr<ImageUint> GenerateRGBA(std::shared_ptr<ImageUint> A);
 }  // namespace SceneClassificationLayer
@@ -2,6 +2,7 @@
 
 #include "Functions.h"
 #include "ImageOperations.h"
+#include "ImagePool.h"
 
 using namespace ImageOperations;
 
@@ -14,14 +15,15 @@ Results Evaluate(
 ) {
     Results ret;
 
-    std::shared_ptr<ImageBool> not_cloud_mask      = NOT(cloud_mask);
-    std::shared_ptr<ImageBool> not_shadow_mask     = NOT(shadow_mask);
-    std::shared_ptr<ImageBool> not_shadow_baseline = NOT(shadow_baseline);
+    auto not_cloud_mask = NOT(lazy(cloud_mask));
 
-    std::shared_ptr<ImageBool> valid_shadow_mask         = AND(shadow_mask, not_cloud_mask);
-    std::shared_ptr<ImageBool> valid_shadow_baseline     = AND(shadow_baseline, not_cloud_mask);
-    std::shared_ptr<ImageBool> valid_not_shadow_mask     = AND(not_shadow_mask, not_cloud_mask);
-    std::shared_ptr<ImageBool> valid_not_shadow_baseline = AND(not_shadow_baseline, not_cloud_mask);
+    std::shared_ptr<ImageBool> valid_shadow_mask = evaluate(AND(lazy(shadow_mask), not_cloud_mask));
+    std::shared_ptr<ImageBool> valid_shadow_baseline
+        = evaluate(AND(lazy(shadow_baseline), not_cloud_mask));
+    std::shared_ptr<ImageBool> valid_not_shadow_mask
+        = evaluate(AND(NOT(lazy(shadow_mask)), not_cloud_mask));
+    std::shared_ptr<ImageBool> valid_not_shadow_baseline
+        = evaluate(AND(NOT(lazy(shadow_baseline)), not_cloud_mask));
 
     std::shared_ptr<ImageBool> valid_true_positives = AND(valid_shadow_mask, valid_shadow_baseline);
     std::shared_ptr<ImageBool> valid_true_negatives
@@ -50,31 +52,21 @@ Results Evaluate(
     ret.producers_accuracy = (1.f - ret.error_relative) / (1.f - ret.positive_error_relative);
     ret.users_accuracy     = (1.f - ret.error_relative) / (1.f - ret.negative_error_relative);
 
-    std::shared_ptr<ImageUint> uint_true_negatives = cast(
-        valid_true_negatives, Results::true_negative_class_value, Results::unknown_class_value
-    );
-    std::shared_ptr<ImageUint> uint_true_positives = cast(
-        valid_true_positives, Results::true_positive_class_value, Results::unknown_class_value
-    );
-    std::shared_ptr<ImageUint> uint_false_negatives = cast(
-        valid_false_negatives, Results::false_negative_class_value, Results::unknown_class_value
-    );
-    std::shared_ptr<ImageUint> uint_false_positives = cast(
-        valid_false_positives, Results::false_positive_class_value, Results::unknown_class_value
-    );
-    std::shared_ptr<ImageUint> uint_clouds
-        = cast(cloud_mask, Results::clouds_class_value, Results::unknown_class_value);
-
-    ret.pixel_classes = ADD(
-        uint_true_negatives,
-        ADD(uint_true_positives, ADD(uint_false_negatives, ADD(uint_false_positives, uint_clouds)))
-    );
+    // The classes are disjoint, so their sum is a single pass over the masks
+    const unsigned int unknown = Results::unknown_class_value;
+    ret.pixel_classes = evaluate(ADD(
+        ADD(cast(lazy(valid_true_negatives), Results::true_negative_class_value, unknown),
+            cast(lazy(valid_true_positives), Results::true_positive_class_value, unknown)),
+        ADD(ADD(cast(lazy(valid_false_negatives), Results::false_negative_class_value, unknown),
+                cast(lazy(valid_false_positives), Results::false_positive_class_value, unknown)),
+            cast(lazy(cloud_mask), Results::clouds_class_value, unknown))
+    ));
 
     return ret;
 }
 
 std::shared_ptr<ImageUint> GenerateRGBA(std::shared_ptr<ImageUint> A) {
-    std::shared_ptr<ImageUint> ret = std::make_shared<ImageUint>(A->rows(), A->cols());
+    std::shared_ptr<ImageUint> ret = ImagePool::Make<unsigned int>(A->rows(), A->cols());
     for (int i = 0; i < ret->size(); i++)
         switch (A->data()[i]) {
             case Results::true_negative_class_value: ret->data()[i] = TRUE_NEGATIVE_COLOUR; break;
@@ -98,18 +90,19 @@ ImageBounds CastedImageBounds(
     Plane ground_plane({0.f, 0.f, 0.f}, {0.f, 0.f, 1.f});
 
     Quad quad;
-    quad.p00 = pos(mask, DiagonalLength, 0, 0, .1f, .1f);  // p11---p10
-    quad.p01 = pos(mask, DiagonalLength, mask->cols() - 1, 0, .9f, .1f);  //  |<<<<<|
-    quad.p10 = pos(mask, DiagonalLength, mask->cols() - 1, mask->rows() - 1, .9f, .9f);  //  |>>>>>|
-    quad.p11 = pos(mask, DiagonalLength, 0, mask->rows() - 1, .1f, .9f);  // p00---p01
+    quad.p00 = pos(*mask, DiagonalLength, 0, 0, .1f, .1f);  // p11---p10
+    quad.p01 = pos(*mask, DiagonalLength, mask->cols() - 1, 0, .9f, .1f);  //  |<<<<<|
+    quad.p10
+        = pos(*mask, DiagonalLength, mask->cols() - 1, mask->rows() - 1, .9f, .9f);  //  |>>>>>|
+    quad.p11 = pos(*mask, DiagonalLength, 0, mask->rows() - 1, .1f, .9f);  // p00---p01
 
     quad = Functions::perspective(quad, view_pos, height_plane);
     quad = Functions::perspective(quad, sun_pos, ground_plane);
 
-    glm::ivec2 p00_index = index(mask, DiagonalLength, quad.p00);
-    glm::ivec2 p01_index = index(mask, DiagonalLength, quad.p01);
-    glm::ivec2 p10_index = index(mask, DiagonalLength, quad.p10);
-    glm::ivec2 p11_index = index(mask, DiagonalLength, quad.p11);
+    glm::ivec2 p00_index = index(*mask, DiagonalLength, quad.p00);
+    glm::ivec2 p01_index = index(*mask, DiagonalLength, quad.p01);
+    glm::ivec2 p10_index = index(*mask, DiagonalLength, quad.p10);
+    glm::ivec2 p11_index = index(*mask, DiagonalLength, quad.p11);
 
     int min_x = std::min(std::min(p00_index.x, p01_index.x), std::min(p10_index.x, p11_index.x));
     int min_y = std::min(std::min(p00_index.y, p01_index.y), std::min(p10_index.y, p11_index.y));
@@ -0,0 +1,203 @@
+#define _USE_MATH_DEFINES
+#include "SyntheticScene.h"
+
+#include <fstream>
+#include <random>
+
+#include <toml++/toml.h>
+
+#include "Functions.h"
+#include "ImageOperations.h"
+#include "Imageio.h"
+#include "SceneClassificationLayer.h"
+
+using namespace ImageOperations;
+
+namespace SyntheticScene {
+static const float EarthRadius    = 6371.f;  // km
+static const float DistanceToSun  = 1.5e9f;  // km
+static const float DistanceToView = 785.f;   // km
+
+// Unit vector towards the source, the same convention as GenerateVectorGrid
+glm::vec3 direction(float zenith, float azimuth) {
+    zenith  = glm::radians(zenith);
+    azimuth = glm::radians(azimuth);
+    return {sinf(zenith) * sinf(azimuth), -sinf(zenith) * cosf(azimuth), cosf(zenith)};
+}
+
+// Per-pixel angles of a source at a finite distance above the scene centre
+void angles(
+    glm::vec3 source,
+    float DiagonalLength,
+    std::shared_ptr<ImageFloat> zenith,
+    std::shared_ptr<ImageFloat> azimuth
+) {
+    for (unsigned int i = 0u; i < (unsigned int)(zenith->cols()); i++) {
+        for (unsigned int j = 0u; j < (unsigned int)(zenith->rows()); j++) {
+            glm::vec3 d = glm::normalize(source - pos(*zenith, DiagonalLength, i, j));
+            set(*zenith, i, j, glm::degrees(acosf(d.z)));
+            set(*azimuth, i, j, glm::degrees(atan2f(d.x, -d.y)));
+        }
+    }
+}
+
+// Cheap deterministic texture so the bands are not flat
+float hash(unsigned int i, unsigned int j, unsigned int seed) {
+    unsigned int h = i * 374761393u + j * 668265263u + seed * 2147483647u;
+    h              = (h ^ (h >> 13)) * 1274126177u;
+    return float((h ^ (h >> 16)) & 0xffffu) / float(0xffffu);
+}
+
+struct Ellipse {
+    glm::vec2 centre;
+    glm::vec2 radii;
+    float angle;
+    bool in(glm::vec2 p) const {
+        glm::vec2 d = p - centre;
+        glm::vec2 r = {
+            (d.x * cosf(angle) + d.y * sinf(angle)) / radii.x,
+            (-d.x * sinf(angle) + d.y * cosf(angle)) / radii.y};
+        return glm::dot(r, r) <= 1.f;
+    }
+};
+
+template<class F>
+void rasterize(const Ellipse &e, int size, F f) {
+    float r       = std::max(e.radii.x, e.radii.y);
+    glm::ivec2 p0 = glm::max(glm::ivec2(e.centre - r), glm::ivec2(0));
+    glm::ivec2 p1 = glm::min(glm::ivec2(e.centre + r) + 1, glm::ivec2(size));
+    for (int i = p0.x; i < p1.x; i++)
+        for (int j = p0.y; j < p1.y; j++)
+            if (e.in(glm::vec2(i, j) + .5f)) f(i, j);
+}
+
+Scene Generate(const Parameters &parameters) {
+    using namespace SceneClassificationLayer;
+    Scene ret;
+    int size     = int(parameters.size);
+    float length = float(size) * parameters.pixelSize;
+    float dLat   = glm::degrees(length / EarthRadius);
+    float dLong  = glm::degrees(length / (EarthRadius * cosf(glm::radians(parameters.origin.y))));
+    ret.bbox           = glm::vec4(parameters.origin, parameters.origin + glm::vec2(dLong, dLat));
+    ret.diagonal       = Functions::distance({ret.bbox.x, ret.bbox.y}, {ret.bbox.z, ret.bbox.w});
+    ret.NIR            = std::make_shared<ImageFloat>(size, size);
+    ret.CLP            = std::make_shared<ImageFloat>(size, size);
+    ret.CLD            = std::make_shared<ImageFloat>(size, size);
+    ret.SCL            = std::make_shared<ImageUint>(size, size);
+    ret.SunZenith      = std::make_shared<ImageFloat>(size, size);
+    ret.SunAzimuth     = std::make_shared<ImageFloat>(size, size);
+    ret.ViewZenith     = std::make_shared<ImageFloat>(size, size);
+    ret.ViewAzimuth    = std::make_shared<ImageFloat>(size, size);
+    ret.shadowBaseline = std::make_shared<ImageBool>(size, size);
+    ret.shadowBaseline->fill(false);
+
+    glm::vec3 centre = pos(*ret.NIR, ret.diagonal, size / 2, size / 2);
+    glm::vec3 sun    = direction(parameters.sunZenith, parameters.sunAzimuth);
+    glm::vec3 view   = direction(parameters.viewZenith, parameters.viewAzimuth);
+    angles(centre + DistanceToSun * sun, ret.diagonal, ret.SunZenith, ret.SunAzimuth);
+    angles(centre + DistanceToView * view, ret.diagonal, ret.ViewZenith, ret.ViewAzimuth);
+
+    // Clear sky, a mix of vegetation and bare soil
+    for (unsigned int i = 0u; i < parameters.size; i++) {
+        for (unsigned int j = 0u; j < parameters.size; j++) {
+            float n = hash(i / 8u, j / 8u, parameters.seed);
+            set(*ret.NIR, i, j, .25f + .15f * n + .02f * hash(i, j, parameters.seed + 1u));
+            set(*ret.CLP, i, j, .05f * hash(i, j, parameters.seed + 2u));
+            set(*ret.CLD, i, j, 0.f);
+            set(*ret.SCL, i, j, n < .3f ? BARE_SOIL_VALUE : VEGITATION_VALUE);
+        }
+    }
+
+    std::mt19937 rng(parameters.seed);
+    std::uniform_real_distribution<float> centres(0.f, float(size));
+    std::uniform_real_distribution<float> radii(parameters.cloudRadius.x, parameters.cloudRadius.y);
+    std::uniform_real_distribution<float> heights(
+        parameters.cloudHeight.x, parameters.cloudHeight.y
+    );
+    std::uniform_real_distribution<float> orientations(0.f, float(M_PI));
+    std::vector<Ellipse> clouds(parameters.cloudCount);
+    std::vector<float> cloudHeights(parameters.cloudCount);
+    for (unsigned int c = 0u; c < parameters.cloudCount; c++) {
+        clouds[c].centre = {centres(rng), centres(rng)};
+        clouds[c].radii  = {radii(rng), radii(rng)};
+        clouds[c].angle  = orientations(rng);
+        cloudHeights[c]  = heights(rng);
+    }
+
+    // The shadow lies where the sun ray through the cloud meets the ground, while the cloud itself
+    // is seen where the view ray through it does, both in pixels relative to the ground below it
+    glm::vec2 sunShift  = -glm::vec2(sun) / (sun.z * parameters.pixelSize);
+    glm::vec2 viewShift = -glm::vec2(view) / (view.z * parameters.pixelSize);
+    for (unsigned int c = 0u; c < parameters.cloudCount; c++) {
+        Ellipse shadow = clouds[c];
+        shadow.centre += cloudHeights[c] * (sunShift - viewShift);
+        rasterize(shadow, size, [&](int i, int j) {
+            set(*ret.NIR, i, j, .3f * at(*ret.NIR, i, j));
+            set(*ret.shadowBaseline, i, j, true);
+        });
+    }
+    float highCloud = .5f * (parameters.cloudHeight.x + parameters.cloudHeight.y);
+    for (unsigned int c = 0u; c < parameters.cloudCount; c++) {
+        unsigned int value = cloudHeights[c] > highCloud ? CLOUD_HIGH_VALUE : CLOUD_MEDIUM_VALUE;
+        rasterize(clouds[c], size, [&](int i, int j) {
+            set(*ret.NIR, i, j, .6f + .2f * hash(i / 4u, j / 4u, parameters.seed + 3u));
+            set(*ret.CLP, i, j, .9f + .1f * hash(i, j, parameters.seed + 4u));
+            set(*ret.CLD, i, j, .8f);
+            set(*ret.SCL, i, j, value);
+            set(*ret.shadowBaseline, i, j, false);
+        });
+    }
+    return ret;
+}
+
+Path Write(const Scene &scene, const Path &directory, const std::string &id) {
+    std::filesystem::create_directories(directory);
+    Path dir = std::filesystem::absolute(directory);
+
+    auto quantize = [](std::shared_ptr<ImageFloat> A, float max) {
+        return std::make_shared<ImageUint>(
+            (A->array().max(0.f).min(1.f) * max).round().cast<unsigned int>()
+        );
+    };
+    std::shared_ptr<ImageUint> baseline = cast<unsigned int>(
+        scene.shadowBaseline, 0xff00ff00u, 0xff000000u  // Green is shadow
+    );
+    std::shared_ptr<ImageUint> rgba = std::make_shared<ImageUint>(
+        (quantize(scene.NIR, 255.f)->array() * 0x010101u) + 0xff000000u
+    );
+    Imageio::WriteSingleChannelUint16(
+        dir / "NIR.tif", quantize(scene.NIR, float(std::numeric_limits<uint16_t>::max()))
+    );
+    Imageio::WriteSingleChannelUint8(
+        dir / "CLP.tif", quantize(scene.CLP, float(std::numeric_limits<uint8_t>::max()))
+    );
+    Imageio::WriteSingleChannelUint8(dir / "CLD.tif", quantize(scene.CLD, 100.f));
+    Imageio::WriteSingleChannelUint8(dir / "SCL.tif", scene.SCL);
+    Imageio::WriteSingleChannelFloat(dir / "SunZenith.tif", scene.SunZenith);
+    Imageio::WriteSingleChannelFloat(dir / "SunAzimuth.tif", scene.SunAzimuth);
+    Imageio::WriteSingleChannelFloat(dir / "ViewZenith.tif", scene.ViewZenith);
+    Imageio::WriteSingleChannelFloat(dir / "ViewAzimuth.tif", scene.ViewAzimuth);
+    Imageio::WriteRGBA(dir / "RBGA.tif", rgba);
+    Imageio::WriteRGBA(dir / "ShadowBaseline.tif", baseline);
+
+    toml::table data{
+        {"ID", id},
+        {"bbox", toml::array{scene.bbox.x, scene.bbox.y, scene.bbox.z, scene.bbox.w}},
+        {"NIR_path", (dir / "NIR.tif").string()},
+        {"CLP_path", (dir / "CLP.tif").string()},
+        {"CLD_path", (dir / "CLD.tif").string()},
+        {"ViewZenith_path", (dir / "ViewZenith.tif").string()},
+        {"ViewAzimuth_path", (dir / "ViewAzimuth.tif").string()},
+        {"SunZenith_path", (dir / "SunZenith.tif").string()},
+        {"SunAzimuth_path", (dir / "SunAzimuth.tif").string()},
+        {"SCL_path", (dir / "SCL.tif").string()},
+        {"RBGA_path", (dir / "RBGA.tif").string()},
+        {"ShadowBaseline_path", (dir / "ShadowBaseline.tif").string()}};
+    Path path = dir / "data.toml";
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Cant open file");
+    file << toml::table{{"Data", data}} << std::endl;
+    if (!file) throw std::runtime_error("Falure when writing file");
+    return path;
+}
+}  // namespace SyntheticScene
@@ -0,0 +1,42 @@
+#pragma once
+#include <memory>
+#include <string>
+
+#include "types.h"
+
+namespace SyntheticScene {
+struct Parameters {
+    unsigned int size       = 1024u;            // Side length in pixels
+    float pixelSize         = .01f;             // km, Sentinel-2 10m bands
+    glm::vec2 origin        = {-110.f, 50.f};   // Min long lat of the bbox
+    unsigned int cloudCount = 40u;
+    glm::vec2 cloudRadius   = {10.f, 60.f};     // Min and max in pixels
+    glm::vec2 cloudHeight   = {1.f, 6.f};       // Min and max in km
+    float sunZenith         = 40.f;             // Degrees
+    float sunAzimuth        = 150.f;            // Degrees
+    float viewZenith        = 5.f;              // Degrees
+    float viewAzimuth       = 100.f;            // Degrees
+    unsigned int seed       = 0u;
+};
+
+// Bands as the main executable holds them after reading and normalizing
+struct Scene {
+    glm::vec4 bbox;  // Min long, min lat, max long, max lat
+    float diagonal;
+    std::shared_ptr<ImageFloat> NIR;
+    std::shared_ptr<ImageFloat> CLP;
+    std::shared_ptr<ImageFloat> CLD;
+    std::shared_ptr<ImageUint> SCL;
+    std::shared_ptr<ImageFloat> SunZenith;
+    std::shared_ptr<ImageFloat> SunAzimuth;
+    std::shared_ptr<ImageFloat> ViewZenith;
+    std::shared_ptr<ImageFloat> ViewAzimuth;
+    std::shared_ptr<ImageBool> shadowBaseline;
+};
+
+// Elliptical clouds at random heights, each casting its shadow along the sun and view geometry
+Scene Generate(const Parameters &parameters);
+
+// Writes every band as a tif in the encoding the readers expect, with a [Data] TOML beside them
+Path Write(const Scene &scene, const Path &directory, const std::string &id);
+}  // namespace SyntheticScene
@@ -5,76 +5,264 @@
 
 #include "Functions.h"
 #include "ImageOperations.h"
+#include "Parallel.h"
 
 namespace VectorGridOperations {
+// Pixels converted per step, small enough for the temporaries to stay in cache
+static const Eigen::Index PixelsPerBlock = 4096;
+
+// Directions of n pixels with the angles multiplied by scale to get radians, Eigen evaluates the
+// sin and cos with its vectorized packet math
+void directions(
+    const float *zenith,
+    const float *azimuth,
+    float scale,
+    Eigen::Index n,
+    float *x,
+    float *y,
+    float *z
+) {
+    Eigen::ArrayXf zen = Eigen::Map<const Eigen::ArrayXf>(zenith, n) * scale;
+    Eigen::ArrayXf azi = Eigen::Map<const Eigen::ArrayXf>(azimuth, n) * scale;
+    Eigen::ArrayXf sz  = zen.sin();
+    Eigen::Map<Eigen::ArrayXf>(x, n) = sz * azi.sin();
+    Eigen::Map<Eigen::ArrayXf>(y, n) = -sz * azi.cos();  // Negated because the y-axis is flipped
+    Eigen::Map<Eigen::ArrayXf>(z, n) = zen.cos();
+}
+
+struct AngleBands {
+    std::shared_ptr<ImageFloat> Zenith;
+    std::shared_ptr<ImageFloat> Azimuth;
+    std::shared_ptr<VectorGrid> grid;
+};
+
+// Every grid is filled in the same parallel sweep over the pixels
+void generate(std::vector<AngleBands> &bands, float scale) {
+    const VectorGrid &held = *bands.front().grid;
+    if (held.stride > 1u) {
+        // Each held row gathered from its image row first, the angles of the pixels between the
+        // samples are never converted
+        Parallel::ForRanges(0, size_t(held.rows()), [&](unsigned int, size_t begin, size_t end) {
+            Eigen::ArrayXf zenith(held.cols()), azimuth(held.cols());
+            for (Eigen::Index r = Eigen::Index(begin); r < Eigen::Index(end); r++)
+                for (auto &b : bands) {
+                    Eigen::Index p = held.imageRow(r) * held.imageCols + held.imageCol(0);
+                    Eigen::InnerStride<> step(held.stride);
+                    zenith = Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>>(
+                        b.Zenith->data() + p, held.cols(), step
+                    );
+                    azimuth = Eigen::Map<const Eigen::ArrayXf, 0, Eigen::InnerStride<>>(
+                        b.Azimuth->data() + p, held.cols(), step
+                    );
+                    directions(
+                        zenith.data(),
+                        azimuth.data(),
+                        scale,
+                        held.cols(),
+                        b.grid->x.data() + r * held.cols(),
+                        b.grid->y.data() + r * held.cols(),
+                        b.grid->z.data() + r * held.cols()
+                    );
+                }
+        });
+        return;
+    }
+    Eigen::Index size = held.size();
+    Parallel::ForRanges(0, size_t(size), [&](unsigned int, size_t begin, size_t end) {
+        for (Eigen::Index p = Eigen::Index(begin); p < Eigen::Index(end); p += PixelsPerBlock) {
+            Eigen::Index n = std::min(PixelsPerBlock, Eigen::Index(end) - p);
+            for (auto &b : bands)
+                directions(
+                    b.Zenith->data() + p,
+                    b.Azimuth->data() + p,
+                    scale,
+                    n,
+                    b.grid->x.data() + p,
+                    b.grid->y.data() + p,
+                    b.grid->z.data() + p
+                );
+        }
+    });
+}
+
 std::shared_ptr<VectorGrid>
 GenerateVectorGrid(std::shared_ptr<ImageFloat> Zenith, std::shared_ptr<ImageFloat> Azimuth) {
     if (!ImageOperations::DIM_CHECK(Zenith, Azimuth)) return nullptr;
-    std::shared_ptr<VectorGrid> ret
-        = std::make_shared<VectorGrid>(Azimuth->rows(), Azimuth->cols());
-    for (int i = 0; i < ret->size(); i++)
-        ret->data()[i]
-            = {sin(Zenith->data()[i]) * sin(Azimuth->data()[i]),
-               -sin(Zenith->data()[i])
-                   * cos(Azimuth->data()[i])  // Negated because the y-axis is flipped
-               ,
-               cos(Zenith->data()[i])};
-    return ret;
+    std::vector<AngleBands> bands
+        = {{Zenith, Azimuth, std::make_shared<VectorGrid>(Azimuth->rows(), Azimuth->cols())}};
+    generate(bands, 1.f);
+    return bands[0].grid;
 }
-float SumOfSquareDistance(std::shared_ptr<VectorGrid> A, float DiagonalLength, glm::vec3 p) {
-    glm::vec3 d(0.f), a(0.f), dist(0.f);
-    float SOSD(0.f);
-    for (unsigned int i = 0u; i < (unsigned int)(A->cols()); i++) {
-        for (unsigned int j = 0u; j < (unsigned int)(A->rows()); j++) {
-            a    = ImageOperations::pos(A, DiagonalLength, i, j);
-            d    = ImageOperations::at(A, i, j);
-            dist = Functions::planeProjection(p - a, d);
-            SOSD += glm::dot(dist, dist);
+
+std::shared_ptr<VectorGrid> GenerateVectorGridFromDegrees(
+    std::shared_ptr<ImageFloat> Zenith, std::shared_ptr<ImageFloat> Azimuth
+) {
+    if (!ImageOperations::DIM_CHECK(Zenith, Azimuth)) return nullptr;
+    std::vector<AngleBands> bands
+        = {{Zenith, Azimuth, std::make_shared<VectorGrid>(Azimuth->rows(), Azimuth->cols())}};
+    generate(bands, float(M_PI) / 180.f);
+    return bands[0].grid;
+}
+
+SunViewVectorGrids GenerateSunViewVectorGrids(
+    std::shared_ptr<ImageFloat> SunZenith,
+    std::shared_ptr<ImageFloat> SunAzimuth,
+    std::shared_ptr<ImageFloat> ViewZenith,
+    std::shared_ptr<ImageFloat> ViewAzimuth,
+    unsigned int stride
+) {
+    if (!ImageOperations::DIM_CHECK(SunZenith, SunAzimuth)
+        || !ImageOperations::DIM_CHECK(SunZenith, ViewZenith)
+        || !ImageOperations::DIM_CHECK(SunZenith, ViewAzimuth))
+        return {nullptr, nullptr};
+    stride = std::max(stride, 1u);
+    std::vector<AngleBands> bands = {
+        {SunZenith,
+         SunAzimuth,
+         std::make_shared<VectorGrid>(SunZenith->rows(), SunZenith->cols(), stride)},
+        {ViewZenith,
+         ViewAzimuth,
+         std::make_shared<VectorGrid>(SunZenith->rows(), SunZenith->cols(), stride)}};
+    generate(bands, float(M_PI) / 180.f);
+    return {bands[0].grid, bands[1].grid};
+}
+
+// Rows per reduction chunk, fixed so sums do not depend on the thread count
+static const size_t RowsPerChunk = 16;
+
+// The held rows and columns used with the pixel centre of each, every stride-th of a full grid or
+// every one of a grid subsampled at the stride
+struct Sampling {
+    Sampling(const VectorGrid &A, float DiagonalLength, unsigned int stride) {
+        stride = std::max(stride, 1u);
+        if (A.stride > 1u && stride != 1u && stride != A.stride)
+            throw std::runtime_error("Vector grid is subsampled at another stride");
+        unsigned int step = (A.stride > 1u) ? 1u : stride;
+        // Only the extent of the whole image is used, the expression is never evaluated
+        glm::vec2 sides
+            = ImageOperations::sides(ImageFloat::Zero(A.imageRows, A.imageCols), DiagonalLength);
+        for (Eigen::Index c = VectorGrid::firstSample(A.cols(), step); c < A.cols(); c += step) {
+            columns.push_back(size_t(c));
+            xs.push_back(sides.x * (float(A.imageCol(c)) + .5f) / float(A.imageCols));
+        }
+        for (Eigen::Index r = VectorGrid::firstSample(A.rows(), step); r < A.rows(); r += step) {
+            rows.push_back(size_t(r));
+            ys.push_back(
+                sides.y * (float(A.imageRows - 1 - A.imageRow(r)) + .5f) / float(A.imageRows)
+            );
         }
     }
-    return SOSD;
+    std::vector<size_t> columns;
+    std::vector<float> xs;  // Pixel centre x of each sampled column, shared by every row
+    std::vector<size_t> rows;
+    std::vector<float> ys;
+};
+
+// Calls f(a, d) for every sample of the sampled rows [begin, end) in memory order, with a the
+// pixel centre as ImageOperations::pos gives it and d the raw grid vector
+template<class F>
+void forEachRay(const VectorGrid &A, const Sampling &S, size_t begin, size_t end, F f) {
+    for (size_t k = begin; k < end; k++) {
+        size_t r        = S.rows[k];
+        glm::vec3 a     = {0.f, S.ys[k], 0.f};
+        const float *dx = A.x.data() + r * A.cols();
+        const float *dy = A.y.data() + r * A.cols();
+        const float *dz = A.z.data() + r * A.cols();
+        for (size_t i = 0; i < S.columns.size(); i++) {
+            size_t c = S.columns[i];
+            a.x      = S.xs[i];
+            f(a, glm::vec3(dx[c], dy[c], dz[c]));
+        }
+    }
+}
+
+bool valid(glm::vec3 a, glm::vec3 d) {
+    return !(isnan(a.x) || isnan(a.y) || isnan(a.z) || isnan(d.x) || isnan(d.y) || isnan(d.z));
+}
+
+float SumOfSquareDistance(std::shared_ptr<VectorGrid> A, float DiagonalLength, glm::vec3 p) {
+    Sampling S  = Sampling(*A, DiagonalLength, 1u);
+    double SOSD = Parallel::Reduce(
+        0,
+        S.rows.size(),
+        RowsPerChunk,
+        0.,
+        [&](size_t begin, size_t end) {
+            double sum = 0.;
+            forEachRay(*A, S, begin, end, [&](glm::vec3 a, glm::vec3 d) {
+                glm::vec3 dist = Functions::planeProjection(p - a, d);
+                sum += double(glm::dot(dist, dist));
+            });
+            return sum;
+        },
+        [](double x, double y) { return x + y; }
+    );
+    return float(SOSD);
 }
-struct __getLSSystemReturn__ {
-    glm::mat3 M;
-    glm::vec3 b;
+
+struct LSAccumulator {
+    double count = 0.;
+    glm::dvec3 b = glm::dvec3(0.), row_0 = glm::dvec3(0.), row_1 = glm::dvec3(0.),
+               row_2 = glm::dvec3(0.);
 };
-__getLSSystemReturn__ __getLSSystem__(std::shared_ptr<VectorGrid> A, float DiagonalLength) {
+
+LSSystem GetLSSystem(std::shared_ptr<VectorGrid> A, float DiagonalLength, unsigned int stride) {
     // Someone had a similar problem, but derived differently then we did, reference only
     // https://stackoverflow.com/questions/48154210/3d-point-closest-to-multiple-lines-in-3d-space
-    glm::vec3 b(0.f), d(0.f), a(0.f), row_0(0.f), row_1(0.f), row_2(0.f);
-    float d_d_sum(0.f);
-    for (unsigned int i = 0u; i < (unsigned int)(A->cols()); i++) {
-        for (unsigned int j = 0u; j < (unsigned int)(A->rows()); j++) {
-            a = ImageOperations::pos(A, DiagonalLength, i, j);
-            d = glm::normalize(ImageOperations::at(A, i, j));
-            if (!(isnan(a.x) || isnan(a.y) || isnan(a.z) || isnan(d.x) || isnan(d.y) || isnan(d.z)
-                )) {
-                d_d_sum += 1.f;
-                b -= Functions::planeProjection(a, d);
-                row_0 += d[0] * d;
-                row_1 += d[1] * d;
-                row_2 += d[2] * d;
-            }
+    Sampling S        = Sampling(*A, DiagonalLength, stride);
+    LSAccumulator sum = Parallel::Reduce(
+        0,
+        S.rows.size(),
+        RowsPerChunk,
+        LSAccumulator(),
+        [&](size_t begin, size_t end) {
+            LSAccumulator acc;
+            forEachRay(*A, S, begin, end, [&](glm::vec3 a, glm::vec3 d) {
+                d = glm::normalize(d);
+                if (!valid(a, d)) return;
+                glm::dvec3 dd = d;
+                acc.count += 1.;
+                acc.b -= glm::dvec3(Functions::planeProjection(a, d));
+                acc.row_0 += dd.x * dd;
+                acc.row_1 += dd.y * dd;
+                acc.row_2 += dd.z * dd;
+            });
+            return acc;
+        },
+        [](LSAccumulator x, const LSAccumulator &y) {
+            x.count += y.count;
+            x.b += y.b;
+            x.row_0 += y.row_0;
+            x.row_1 += y.row_1;
+            x.row_2 += y.row_2;
+            return x;
         }
-    }
-    glm::mat3 M = {
+    );
+    // The diagonal nearly cancels for rays close to one axis, so it is formed in double and only
+    // the finished matrix is narrowed
+    glm::dvec3 &row_0 = sum.row_0, &row_1 = sum.row_1, &row_2 = sum.row_2;
+    double d_d_sum    = sum.count;
+    glm::dmat3 M      = {
         {row_0.x - d_d_sum, row_1.x, row_2.x}  // Column 0
         ,
         {row_0.y, row_1.y - d_d_sum, row_2.y}  // Column 1
         ,
         {row_0.z, row_1.z, row_2.z - d_d_sum}  // Column 2
     };
-    return {M, b};
-};
+    return {glm::mat3(M), glm::vec3(sum.b)};
+}
 
 //(NOT USED)
 LMSPointReturn LSPoint(std::shared_ptr<VectorGrid> A, float DiagonalLength) {
-    auto system = __getLSSystem__(A, DiagonalLength);
+    auto system = GetLSSystem(A, DiagonalLength);
     return {Functions::solve(system.M, system.b), false, 0.f};
 }
 
 LMSPointReturn LSPointEqualTo(std::shared_ptr<VectorGrid> A, float DiagonalLength, float z) {
-    auto system = __getLSSystem__(A, DiagonalLength);
+    return LSPointEqualTo(GetLSSystem(A, DiagonalLength), z);
+}
+
+LMSPointReturn LSPointEqualTo(const LSSystem &system, float z) {
     glm::mat4 M_4
         = {{system.M[0], 0.f}, {system.M[1], 0.f}, {system.M[2], 1.f}, {0.f, 0.f, .5f, 0.f}};
     glm::vec4 b_4    = {system.b, z};
@@ -85,7 +273,7 @@ LMSPointReturn LSPointEqualTo(std::shared_ptr<VectorGrid> A, float DiagonalLengt
 //(NOT USED)
 LMSPointReturn
 LSPointGreaterThan(std::shared_ptr<VectorGrid> A, float DiagonalLength, float min_z) {
-    auto system = __getLSSystem__(A, DiagonalLength);
+    auto system = GetLSSystem(A, DiagonalLength);
     glm::mat4 M_4
         = {{system.M[0], 0.f}, {system.M[1], 0.f}, {system.M[2], 1.f}, {0.f, 0.f, .5f, 0.f}};
     glm::vec4 b_4 = {system.b, min_z};
@@ -107,7 +295,7 @@ LSPointGreaterThan(std::shared_ptr<VectorGrid> A, float DiagonalLength, float mi
 
 //(NOT USED)
 LMSPointReturn LSPointLessThan(std::shared_ptr<VectorGrid> A, float DiagonalLength, float max_z) {
-    auto system = __getLSSystem__(A, DiagonalLength);
+    auto system = GetLSSystem(A, DiagonalLength);
     glm::mat4 M_4
         = {{system.M[0], 0.f}, {system.M[1], 0.f}, {system.M[2], 1.f}, {0.f, 0.f, .5f, 0.f}};
     glm::vec4 b_4 = {system.b, max_z};
@@ -128,21 +316,55 @@ LMSPointReturn LSPointLessThan(std::shared_ptr<VectorGrid> A, float DiagonalLeng
 }
 
 float AverageDotProduct(std::shared_ptr<VectorGrid> A, float DiagonalLength, glm::vec3 pos) {
-    glm::vec3 d(0.f), a(0.f);
-    float count(0), sum(0.f);
-    for (unsigned int i = 0u; i < (unsigned int)(A->cols()); i++) {
-        for (unsigned int j = 0u; j < (unsigned int)(A->rows()); j++) {
-            a = ImageOperations::pos(A, DiagonalLength, i, j);
-            d = glm::normalize(ImageOperations::at(A, i, j));
-            if (!(isnan(a[0]) || isnan(a[1]) || isnan(a[2]) || isnan(d[0]) || isnan(d[1])
-                  || isnan(d[2]))) {
-                count += 1.f;
-                sum += glm::dot(d, glm::normalize(pos - a));
-            }
+    return AverageDotProducts(A, DiagonalLength, {pos})[0];
+}
+
+std::vector<float> AverageDotProducts(
+    std::shared_ptr<VectorGrid> A,
+    float DiagonalLength,
+    const std::vector<glm::vec3> &positions,
+    unsigned int stride
+) {
+    struct Sums {
+        double count = 0.;
+        std::vector<double> dots;
+    };
+    Sampling S = Sampling(*A, DiagonalLength, stride);
+    Sums sum   = Parallel::Reduce(
+        0,
+        S.rows.size(),
+        RowsPerChunk,
+        Sums{0., std::vector<double>(positions.size(), 0.)},
+        [&](size_t begin, size_t end) {
+            Sums acc{0., std::vector<double>(positions.size(), 0.)};
+            forEachRay(*A, S, begin, end, [&](glm::vec3 a, glm::vec3 d) {
+                d = glm::normalize(d);
+                if (!valid(a, d)) return;
+                acc.count += 1.;
+                for (size_t k = 0; k < positions.size(); k++)
+                    acc.dots[k] += double(glm::dot(d, glm::normalize(positions[k] - a)));
+            });
+            return acc;
+        },
+        [](Sums x, const Sums &y) {
+            x.count += y.count;
+            for (size_t k = 0; k < x.dots.size(); k++)
+                x.dots[k] += y.dots[k];
+            return x;
         }
-    }
-    return sum / count;
+    );
+    std::vector<float> ret(positions.size());
+    for (size_t k = 0; k < ret.size(); k++)
+        ret[k] = float(sum.dots[k] / sum.count);
+    return ret;
 }
 
-glm::vec3 AverageDirection(std::shared_ptr<VectorGrid> A) { return normalize(A->mean()); }
+unsigned int NativeStride(std::shared_ptr<ImageFloat> A, float DiagonalLength, float spacing) {
+    glm::vec2 pixel = ImageOperations::sides(*A, DiagonalLength) / glm::vec2(A->cols(), A->rows());
+    return std::max(1u, (unsigned int)(roundf(spacing / std::max(pixel.x, pixel.y))));
+}
+
+glm::vec3 AverageDirection(std::shared_ptr<VectorGrid> A) {
+    return normalize(glm::vec3(A->x.mean(), A->y.mean(), A->z.mean()));
+}
 }  // namespace VectorGridOperations
\ No newline at end of file
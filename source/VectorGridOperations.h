@@ -1,9 +1,29 @@
 #pragma once
+#include <vector>
+
 #include "types.h"
 
 namespace VectorGridOperations {
+// Angles in radians
 std::shared_ptr<VectorGrid>
 GenerateVectorGrid(std::shared_ptr<ImageFloat> Zenith, std::shared_ptr<ImageFloat> Azimuth);
+// Angles in degrees as they are read, converted on the fly without a radians copy
+std::shared_ptr<VectorGrid> GenerateVectorGridFromDegrees(
+    std::shared_ptr<ImageFloat> Zenith, std::shared_ptr<ImageFloat> Azimuth
+);
+struct SunViewVectorGrids {
+    std::shared_ptr<VectorGrid> sun;
+    std::shared_ptr<VectorGrid> view;
+};
+// Both grids from degrees in a single pass, with a stride subsampled to hold only the pixels a
+// solve at that stride reads
+SunViewVectorGrids GenerateSunViewVectorGrids(
+    std::shared_ptr<ImageFloat> SunZenith,
+    std::shared_ptr<ImageFloat> SunAzimuth,
+    std::shared_ptr<ImageFloat> ViewZenith,
+    std::shared_ptr<ImageFloat> ViewAzimuth,
+    unsigned int stride = 1u
+);
 
 float SumOfSquareDistance(std::shared_ptr<VectorGrid> A, float DiagonalLength, glm::vec3 p);
 
@@ -12,11 +32,33 @@ struct LMSPointReturn {
     bool bounded;
     float lambda;
 };
+// Normal equations for the point closest to every ray of the grid, independent of any constraint
+struct LSSystem {
+    glm::mat3 M;
+    glm::vec3 b;
+};
+// With a stride only every stride-th row and column contributes, the angle bands are smooth so a
+// coarse sample gives nearly the full resolution solution. A subsampled grid takes 1 or its own
+// stride, either uses every pixel it holds
+LSSystem
+GetLSSystem(std::shared_ptr<VectorGrid> A, float DiagonalLength, unsigned int stride = 1u);
+
 LMSPointReturn LSPoint(std::shared_ptr<VectorGrid> A, float DiagonalLength);
 LMSPointReturn LSPointEqualTo(std::shared_ptr<VectorGrid> A, float DiagonalLength, float z);
+LMSPointReturn LSPointEqualTo(const LSSystem &system, float z);
 LMSPointReturn LSPointGreaterThan(std::shared_ptr<VectorGrid> A, float DiagonalLength, float min_z);
 LMSPointReturn LSPointLessThan(std::shared_ptr<VectorGrid> A, float DiagonalLength, float max_z);
 
 float AverageDotProduct(std::shared_ptr<VectorGrid> A, float DiagonalLength, glm::vec3 pos);
+// One pass over the grid for every position, spread over all cores
+std::vector<float> AverageDotProducts(
+    std::shared_ptr<VectorGrid> A,
+    float DiagonalLength,
+    const std::vector<glm::vec3> &positions,
+    unsigned int stride = 1u
+);
+// Stride whose samples of the angle band A are spacing km apart, Sentinel-2 provides the angles on
+// a 5 km grid
+unsigned int NativeStride(std::shared_ptr<ImageFloat> A, float DiagonalLength, float spacing = 5.f);
 glm::vec3 AverageDirection(std::shared_ptr<VectorGrid> A);
 }  // namespace VectorGridOperations
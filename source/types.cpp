@@ -1,5 +1,50 @@
 #include "types.h"
 
+#include <algorithm>
+
+VectorGrid::VectorGrid(Eigen::Index rows, Eigen::Index cols)
+    : x(rows, cols)
+    , y(rows, cols)
+    , z(rows, cols)
+    , imageRows(rows)
+    , imageCols(cols) {}
+VectorGrid::VectorGrid(Eigen::Index imageRows, Eigen::Index imageCols, unsigned int stride)
+    : VectorGrid(
+          (imageRows - firstSample(imageRows, stride) + stride - 1) / stride,
+          (imageCols - firstSample(imageCols, stride) + stride - 1) / stride
+      ) {
+    this->imageRows = imageRows;
+    this->imageCols = imageCols;
+    this->stride    = stride;
+}
+Eigen::Index VectorGrid::rows() const { return x.rows(); }
+Eigen::Index VectorGrid::cols() const { return x.cols(); }
+Eigen::Index VectorGrid::size() const { return x.size(); }
+Eigen::Index VectorGrid::imageRow(Eigen::Index row) const {
+    return firstSample(imageRows, stride) + row * stride;
+}
+Eigen::Index VectorGrid::imageCol(Eigen::Index col) const {
+    return firstSample(imageCols, stride) + col * stride;
+}
+Eigen::Index VectorGrid::firstSample(Eigen::Index n, unsigned int stride) {
+    return std::min<Eigen::Index>(stride / 2u, n - 1);
+}
+glm::vec3 VectorGrid::operator()(Eigen::Index row, Eigen::Index col) const {
+    return {x(row, col), y(row, col), z(row, col)};
+}
+std::vector<glm::vec3> VectorGrid::interleaved() const {
+    std::vector<glm::vec3> ret(size());
+    for (Eigen::Index i = 0; i < size(); i++)
+        ret[i] = {x.data()[i], y.data()[i], z.data()[i]};
+    return ret;
+}
+
+BitImage::BitImage(unsigned int width, unsigned int height)
+    : width(width)
+    , height(height)
+    , stride((width + 63u) / 64u)
+    , words(size_t(stride) * height, 0u) {}
+
 glm::u32 ImageBounds::size() { return (p1.x - p0.x + 1) * (p1.y - p0.y + 1); }
 
 std::vector<glm::vec3> ImageBounds::lineStrip() {
@@ -11,6 +56,24 @@ std::vector<glm::vec3> ImageBounds::lineStrip() {
         {p0.x, p0.y, 0.f}};
 }
 
+size_t PixelsQuads::area(size_t k) const {
+    size_t ret = 0u;
+    for (auto &run : list(k))
+        ret += run.size();
+    return ret;
+}
+void PixelsQuads::push_back(int id, const ImageBounds &bound, const Quad &quad) {
+    ids.push_back(id);
+    bounds.push_back(bound);
+    quads.push_back(quad);
+    offsets.push_back(runs.size());
+}
+void PixelsQuads::append(unsigned int i, unsigned int j) {
+    if (runs.size() > offsets.back() && runs.back().j == j && runs.back().i1 + 1u == i)
+        runs.back().i1 = i;
+    else runs.push_back({j, i, i});
+}
+
 // ------------- LINE ---------------
 Line::Line()
     : p0({0.f, 0.f, 0.f})
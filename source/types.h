@@ -1,6 +1,9 @@
 #pragma once
+#include <cstdint>
 #include <filesystem>
 #include <map>
+#include <span>
+#include <vector>
 
 #include <Eigen/Core>
 
@@ -17,18 +20,49 @@ using ImageFloat = Image<float>;
 using ImageBool  = Image<bool>;
 using ImageInt   = Image<int>;
 using ImageUint  = Image<unsigned int>;
-using VectorGrid = Image<glm::vec3>;
+
+// One direction per pixel, each component in its own row-major plane. A subsampled grid holds
+// only every stride-th row and column of an imageRows by imageCols image, starting half a stride
+// in so each sample sits near the centre of the block it stands for
+struct VectorGrid {
+    VectorGrid() = default;
+    VectorGrid(Eigen::Index rows, Eigen::Index cols);
+    VectorGrid(Eigen::Index imageRows, Eigen::Index imageCols, unsigned int stride);
+    Eigen::Index rows() const;  // Held, as are the columns and size
+    Eigen::Index cols() const;
+    Eigen::Index size() const;
+    Eigen::Index imageRow(Eigen::Index row) const;
+    Eigen::Index imageCol(Eigen::Index col) const;
+    glm::vec3 operator()(Eigen::Index row, Eigen::Index col) const;
+    std::vector<glm::vec3> interleaved() const;  // For uploading as a vec3 buffer
+    // First of every stride-th of n pixels
+    static Eigen::Index firstSample(Eigen::Index n, unsigned int stride);
+    ImageFloat x, y, z;
+    Eigen::Index imageRows = 0, imageCols = 0;
+    unsigned int stride = 1u;
+};
+
+// One bit per pixel (i, j) as ImageOperations::at indexes them, each j a run of 64 bit words
+struct BitImage {
+    BitImage() = default;
+    BitImage(unsigned int width, unsigned int height);
+    const uint64_t *row(unsigned int j) const { return words.data() + size_t(j) * stride; }
+    bool at(unsigned int i, unsigned int j) const { return (row(j)[i >> 6] >> (i & 63u)) & 1u; }
+    void set(unsigned int i, unsigned int j) {
+        words[size_t(j) * stride + (i >> 6)] |= uint64_t(1) << (i & 63u);
+    }
+    unsigned int width  = 0u;
+    unsigned int height = 0u;
+    unsigned int stride = 0u;  // Words per j
+    std::vector<uint64_t> words;
+};
+
 struct ImageBounds {
     glm::uvec2 p0;
     glm::uvec2 p1;
     glm::u32 size();
     std::vector<glm::vec3> lineStrip();
 };
-struct Pixels {
-    ImageBounds bounds;
-    std::vector<glm::uvec2> list;
-    int id;
-};
 
 struct Quad {
     Quad() = default;
@@ -40,20 +74,32 @@ struct Quad {
 Quad operator*(glm::mat4 M, Quad q);
 Quad operator*(Quad q, glm::mat4 M);
 
-struct PixelsQuad {
-    Pixels pixels;
-    Quad quad;
+// The pixels (i, j) of one j for i in [i0, i1]
+struct PixelRun {
+    unsigned int size() const { return i1 - i0 + 1u; }
+    unsigned int j, i0, i1;
 };
 
-using Cloud      = Pixels;
-using Clouds     = std::map<int, Cloud>;
-using CloudQuad  = PixelsQuad;
-using CloudQuads = std::map<int, CloudQuad>;
-
-using Shadow      = Pixels;
-using Shadows     = std::map<int, Shadow>;
-using ShadowQuad  = PixelsQuad;
-using ShadowQuads = std::map<int, ShadowQuad>;
+// Objects of a scene as one table, object k owns runs [offsets[k], offsets[k + 1]), ordered by
+// j then i and never touching within a j
+struct PixelsQuads {
+    size_t size() const { return ids.size(); }
+    std::span<const PixelRun> list(size_t k) const {
+        return {runs.data() + offsets[k], runs.data() + offsets[k + 1]};
+    }
+    size_t area(size_t k) const;
+    // Adds an object made of the runs appended since the last one
+    void push_back(int id, const ImageBounds &bound, const Quad &quad);
+    // Appends pixel (i, j) to the object being built, in the order of its runs
+    void append(unsigned int i, unsigned int j);
+    std::vector<int> ids;
+    std::vector<ImageBounds> bounds;
+    std::vector<Quad> quads;
+    std::vector<size_t> offsets = {0u};
+    std::vector<PixelRun> runs;
+};
+using CloudQuads  = PixelsQuads;
+using ShadowQuads = PixelsQuads;
 
 struct Line {
     Line();